@@ -25,12 +25,19 @@ function mem() end
 -- @treturn bio
 function socket() end
 
---- make dgram bio from socket fd
+--- make dgram bio from socket fd, a connected socket sends to its peer
 -- @tparam number fd
 -- @tparam[opt='noclose'] flag support 'close' or 'noclose' when close or gc
 -- @treturn bio
 function dgram() end
 
+--- make a pair of connected bio objects, data written to one end can be read from the other
+-- @tparam[opt=0] number size1 buffer size of the first bio, 0 for openssl default
+-- @tparam[opt=size1] number size2 buffer size of the second bio
+-- @treturn bio
+-- @treturn bio
+function pair() end
+
 --- make socket or file bio with fd
 -- @tparam number fd
 -- @tparam[opt='noclose'] flag support 'close' or 'noclose' when close or gc
@@ -96,13 +103,19 @@ do  -- define bio
 -- @treturn string string length may be less than param len
 function read() end
 
+--- read data from bio object and append to buffer
+-- @tparam buffer buf
+-- @tparam[opt] number len max bytes, default to spare capacity of buf
+-- @treturn number bytes appended, 0 when should retry
+function read() end
+
 --- get line from bio object
 -- @tparam[opt=256] number max line len
 -- @treturn string string length may be less than param len
 function gets() end
 
 --- write data to bio object
--- @tparam string data
+-- @tparam string|buffer data
 -- @treturn number length success write
 function write() end
 
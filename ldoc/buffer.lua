@@ -0,0 +1,75 @@
+--- 
+-- Provide mutable byte buffer in lua, used to avoid copies on data paths.
+--
+-- cipher_ctx update/final, digest_ctx update, ssl read/write and bio read/write
+-- accept openssl.buffer in place of lua string.
+--
+-- @module buffer
+-- @usage
+--  buffer = require('openssl').buffer
+--
+
+do  -- define module function
+
+--- create buffer object
+--
+-- @tparam[opt=4096] number|string init capacity, or string to copy as content
+-- @treturn buffer buffer object
+--
+-- @see buffer
+function new() end
+
+end
+
+do  -- define class
+
+--- openssl.buffer object, contiguous bytes with length and capacity
+-- @type buffer
+--
+
+do  -- define buffer
+
+--- get length of content, same as # operator
+--
+-- @treturn number length
+function len() end
+
+--- get allocated capacity
+--
+-- @treturn number capacity
+function capacity() end
+
+--- grow capacity, keep content
+--
+-- @tparam number size
+-- @treturn buffer self
+function reserve() end
+
+--- set length of content, new bytes are zero
+--
+-- @tparam number len
+-- @treturn buffer self
+function resize() end
+
+--- set length to zero, keep capacity
+--
+-- @tparam[opt=false] boolean cleanse overwrite memory, use for secrets
+-- @treturn buffer self
+function clear() end
+
+--- append data to content
+--
+-- @tparam string|buffer data
+-- @treturn buffer self
+function append() end
+
+--- get content as lua string
+--
+-- @tparam[opt=1] number i start position, like string.sub
+-- @tparam[opt=-1] number j end position, like string.sub
+-- @treturn string content
+function tostring() end
+
+end
+
+end
@@ -106,6 +106,75 @@ function encrypt() end
 -- @tparam[opt] engine engine custom crypto engine
 -- @treturn string result decrypt data
 function decrypt() end
+
+--- authenticated encrypt with AEAD cipher, GCM, CCM or ChaCha20-Poly1305, in single pass
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string key secret key, must match key length of alg
+-- @tparam string nonce unique per key, 12 bytes recommended
+-- @tparam string input data to encrypt
+-- @tparam[opt] string aad additional data authenticated but not encrypted
+-- @tparam[opt=16] number taglen length of tag
+-- @treturn string encrypted data
+-- @treturn string tag
+function seal() end
+
+--- authenticated decrypt with AEAD cipher
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string key secret key
+-- @tparam string nonce used by seal
+-- @tparam string input data to decrypt
+-- @tparam string tag returned by seal
+-- @tparam[opt] string aad additional data passed to seal
+-- @treturn string decrypted data, or nil followed by reason when authentication failed
+function open() end
+
+--- encrypt large data with AES CTR or GCM on several threads, result is same as serial one.
+-- Before OpenSSL 1.1.0 chunks run serially on calling thread.
+-- Data is split into block aligned chunks, GCM tag is combined from GHASH of chunks
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string key secret key
+-- @tparam string iv 16 bytes initial counter for CTR, 12 bytes nonce for GCM
+-- @tparam string|buffer data, buffer is encrypted in place
+-- @tparam[opt] table options threads (default number of cpus), aad and taglen (default 16) for GCM
+-- @treturn string|buffer encrypted data
+-- @treturn string tag for GCM
+function encrypt_parallel() end
+
+--- decrypt large data with AES CTR or GCM on several threads
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string key secret key
+-- @tparam string iv 16 bytes initial counter for CTR, 12 bytes nonce for GCM
+-- @tparam string|buffer data, buffer is decrypted in place
+-- @tparam[opt] table options threads, aad, and tag which is required for GCM
+-- @treturn string|buffer decrypted data, or nil followed by reason when authentication failed
+function decrypt_parallel() end
+
+--- encrypt file to file with constant memory, input is read in chunks with sequential read ahead
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity, CCM is not supported
+-- @tparam string key secret key
+-- @tparam[opt] string iv
+-- @tparam string in_path file to encrypt
+-- @tparam string out_path file to write, removed when fail, must not be in_path
+-- @treturn number bytes written
+-- @treturn string tag when alg is AEAD
+function encrypt_file() end
+
+--- decrypt file to file with constant memory
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity, CCM is not supported
+-- @tparam string key secret key
+-- @tparam[opt] string iv
+-- @tparam string in_path file to decrypt
+-- @tparam string out_path file to write, removed when fail or authentication failed,
+-- must not be in_path
+-- @tparam[opt] string tag required when alg is AEAD
+-- @treturn number bytes written
+function decrypt_file() end
  
 end
 
@@ -162,6 +231,27 @@ function encrypt() end
 -- @treturn string result
 function decrypt() end
 
+--- authenticated encrypt with AEAD cipher, GCM, CCM or ChaCha20-Poly1305, in single pass
+--
+-- @tparam string key secret key, must match key length of alg
+-- @tparam string nonce unique per key, 12 bytes recommended
+-- @tparam string input data to encrypt
+-- @tparam[opt] string aad additional data authenticated but not encrypted
+-- @tparam[opt=16] number taglen length of tag
+-- @treturn string encrypted data
+-- @treturn string tag
+function seal() end
+
+--- authenticated decrypt with AEAD cipher
+--
+-- @tparam string key secret key
+-- @tparam string nonce used by seal
+-- @tparam string input data to decrypt
+-- @tparam string tag returned by seal
+-- @tparam[opt] string aad additional data passed to seal
+-- @treturn string decrypted data, or nil followed by reason when authentication failed
+function open() end
+
 --- get evp_cipher_ctx to encrypt or decrypt 
 --
 -- @tparam boolean encrypt true for encrypt,false for decrypt
@@ -212,15 +302,55 @@ function info() end
   
 --- feed data to do cipher
 --
--- @tparam string msg data
+-- @tparam string|buffer msg data
 -- @treturn string result parture result
 function update() end
 
+--- feed data to do cipher, output replaces content of out without making lua string,
+-- msg and out can be same buffer to cipher in place
+--
+-- @tparam string|buffer msg data
+-- @tparam buffer out
+-- @treturn number length of output
+function update() end
+
 --- get result of cipher
 --
 -- @treturn string result last result
 function final() end
 
+--- get result of cipher and append to buffer
+--
+-- @tparam buffer out
+-- @treturn number length appended
+function final() end
+
+--- feed additional authenticated data of AEAD cipher, before any update,
+-- CCM can not stream and raises error, use seal or open instead
+--
+-- @tparam string aad
+-- @treturn boolean result
+function aad() end
+
+--- get tag after final of AEAD encrypt, CCM raises error
+--
+-- @tparam[opt=16] number taglen
+-- @treturn string tag
+function tag() end
+
+--- set expected tag before final of AEAD decrypt, final fails when not match
+--
+-- @tparam string tag
+-- @treturn boolean result
+function tag() end
+
+--- reinit to process a new message with new iv, keep key schedule when key omitted
+--
+-- @tparam string iv
+-- @tparam[opt] string key new secret key
+-- @treturn boolean result
+function reset() end
+
 end
 
 end
@@ -38,6 +38,59 @@ function new() end
 -- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
 -- @treturn string digest result value
 function digest() end
+
+--- digest file content with constant memory, file is mapped and read ahead by kernel
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string path file to digest
+-- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
+-- @treturn string digest result value
+function file() end
+
+--- compute several digests in one pass over input
+--
+-- @tparam table algs list of alg names or evp_digest objects, at most 16
+-- @tparam string|buffer|bio|file input data, or bio and lua file handle read to end
+-- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
+-- @treturn string digest results in order of algs
+-- @usage md5, sha1, sha256 = digest.multi({'md5', 'sha1', 'sha256'}, io.open(path, 'rb'))
+function multi() end
+
+--- create digest_multi object to compute several digests over streamed data
+--
+-- @tparam table algs list of alg names or evp_digest objects, at most 16
+-- @treturn digest_multi
+-- @see digest_multi
+function multi_new() end
+
+--- compute Merkle tree hash, leaves are hashed in parallel.
+-- Leaf is H(0x00 .. data) over fixed size leaves, node is H(0x01 .. left .. right)
+-- as RFC 6962, empty input gives H('')
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string|buffer data
+-- @tparam[opt] table options leaf (size, default 1M), threads (default number of cpus,
+-- serial before OpenSSL 1.1.0), raw (binary root) and leaves (also return leaf digests)
+-- @treturn string root digest
+-- @treturn[opt] table binary digest of each leaf when options.leaves
+function tree() end
+
+--- compute Merkle tree hash of file, each thread reads its own range of leaves
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam string path
+-- @tparam[opt] table options same as tree
+-- @treturn string root digest
+-- @treturn[opt] table binary digest of each leaf when options.leaves
+function tree_file() end
+
+--- compute Merkle tree root from leaf digests, to verify or resume tree hash
+--
+-- @tparam string|integer|asn1_object alg name, nid or object identity
+-- @tparam table leaves binary leaf digests
+-- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
+-- @treturn string root digest
+function tree_root() end
  
 end
 
@@ -67,6 +120,13 @@ function info() end
 -- @treturn string result a binary hash value for msg
 function digest() end
 
+--- digest file content with constant memory
+--
+-- @tparam string path file to digest
+-- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
+-- @treturn string digest result value
+function file() end
+
 end
 
 do  -- define evp_digest_ctx
@@ -82,7 +142,7 @@ function info() end
 
 --- feed data to do digest
 --
--- @tparam string msg data
+-- @tparam string|buffer msg data
 -- @treturn boolean result true for success
 function update() end
 
@@ -100,7 +160,24 @@ function reset() end
 
 end
 
-end
+do  -- define digest_multi
+
+--- openssl.digest_multi object
+-- @type digest_multi
+--
 
+--- feed data to all digests, slices of data are hashed by each digest while cache hot
+--
+-- @tparam string|buffer|bio|file data, or bio and lua file handle read to end
+-- @treturn boolean result true for success
+function update() end
 
+--- get results of all digests, object can continue to update
+--
+-- @tparam[opt] boolean raw binary result return if set true, or hex encoded string default
+-- @treturn string digest results in order of algs
+function final() end
+
+end
 
+end
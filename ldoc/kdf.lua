@@ -0,0 +1,96 @@
+--- 
+-- Provide key derivation functions in lua.
+--
+-- Long running derivations can run on a background thread with kdf.async,
+-- leaving lua free to do other work until result is needed.
+--
+-- @module kdf
+-- @usage
+--  kdf = require('openssl').kdf
+--
+
+do  -- define module function
+
+--- derive key with PKCS5 PBKDF2-HMAC
+--
+-- @tparam string password
+-- @tparam string salt
+-- @tparam number iter iteration count
+-- @tparam number keylen length of key to derive
+-- @tparam[opt='sha256'] evp_digest|string|nid md digest alg identity
+-- @treturn string derived key, or nil followed by error message
+function pbkdf2() end
+
+--- derive key with HKDF, RFC 5869 extract then expand
+--
+-- @tparam evp_digest|string|nid md digest alg identity
+-- @tparam string ikm input keying material
+-- @tparam[opt] string salt, nil means HashLen zeros
+-- @tparam[opt=''] string info context information
+-- @tparam number keylen length of key to derive, not more than 255*HashLen
+-- @treturn string derived key, or nil followed by error message
+function hkdf() end
+
+--- HKDF extract step
+--
+-- @tparam evp_digest|string|nid md digest alg identity
+-- @tparam string ikm input keying material
+-- @tparam[opt] string salt, nil means HashLen zeros
+-- @treturn string pseudorandom key, HashLen bytes
+function hkdf_extract() end
+
+--- HKDF expand step
+--
+-- @tparam evp_digest|string|nid md digest alg identity
+-- @tparam string prk pseudorandom key
+-- @tparam[opt=''] string info context information
+-- @tparam number keylen length of key to derive, not more than 255*HashLen
+-- @treturn string derived key, or nil followed by error message
+function hkdf_expand() end
+
+--- derive key with scrypt, only with openssl 1.1.0 or above
+--
+-- @tparam string password
+-- @tparam string salt
+-- @tparam number N cost parameter, power of 2
+-- @tparam number r block size
+-- @tparam number p parallelization
+-- @tparam number keylen length of key to derive
+-- @tparam[opt=0] number maxmem memory limit in bytes, 0 means openssl default
+-- @treturn string derived key, or nil followed by error message
+function scrypt() end
+
+--- start key derivation on a background thread
+--
+-- inputs are copied, so lua strings may be collected after call.
+-- without thread support, or before OpenSSL 1.1.0, derivation runs before return.
+-- a job collected before it finished does not block gc, its thread frees it.
+--
+-- @tparam string name one of 'pbkdf2', 'hkdf', 'hkdf_extract', 'hkdf_expand', 'scrypt'
+-- @param ... arguments same as function of name
+-- @treturn kdf_job
+function async() end
+
+end
+
+do  -- define class
+
+--- openssl.kdf_job object
+-- @type kdf_job
+--
+
+do  -- define kdf_job
+
+--- check whether derivation finished, never blocks
+--
+-- @treturn boolean
+function done() end
+
+--- wait derivation finish and get result
+--
+-- @treturn string derived key, or nil followed by error message
+function result() end
+
+end
+
+end
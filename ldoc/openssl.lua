@@ -9,11 +9,24 @@
 do  -- define module function
 
 --- hex encode or decode string
--- @tparam string str
+--
+-- decode returns nil followed by error message on odd length input or a
+-- character out of 0-9, a-f and A-F, earlier versions returned garbage.
+-- @tparam string|buffer str
 -- @tparam[opt=true] boolean encode true to encoed, false to decode
--- @treturn string
+-- @treturn string, or nil followed by error message when decode invalid input
 function hex() end
 
+--- base64 encode or decode string, without BIO
+--
+-- decode accepts both base64 and base64url alphabets, optional padding
+-- and skips whitespace.
+-- @tparam string|buffer str
+-- @tparam[opt=true] boolean encode true to encode, false to decode
+-- @tparam[opt=false] boolean url true to encode base64url without padding
+-- @treturn string, or nil followed by error message when decode invalid input
+function base64() end
+
 --- get method names
 -- @tparam string type support 'cipher','digests','pkeys','comps'
 -- @treturn table as array
@@ -9,7 +9,7 @@
 do  -- define module function
 
 --- create ssl_ctx object, which mapping to SSL_CTX in openssl.
--- @tparam string protocol support 'SSLv3', 'SSLv23', 'SSLv2', 'TSLv1', 'DTLSv1', and can be follow by '-server' or '-client'
+-- @tparam string protocol support 'SSLv3', 'SSLv23', 'SSLv2', 'TSLv1', 'DTLSv1', 'DTLSv1_2', 'DTLS', and can be follow by '-server' or '-client'
 -- @tparam[opt] string support_ciphers, if not given, default of openssl will be used
 -- @treturn ssl_ctx
 function ctx_new() end
@@ -20,6 +20,15 @@ function ctx_new() end
 -- @treturn string alert type
 -- @treturn string desc string, if long set true will return long info
 function alert_string() end
+
+--- create a client and a server ssl object connected back-to-back by a bio pair,
+-- useful to run handshake and record layer without any socket
+-- @tparam ssl_ctx client_ctx
+-- @tparam[opt=client_ctx] ssl_ctx server_ctx
+-- @tparam[opt=0] number size buffer size of bio pair, 0 for openssl default
+-- @treturn ssl client
+-- @treturn ssl server
+function pair() end
  
 end
 
@@ -46,11 +55,19 @@ function used() end
 function add() end
 
 --- set temp callback 
+-- tmp_cb(is_export, keylength) return key pem string, or built-in group name for 'dh'.
+-- Parsed result is cached per (is_export, keylength), tmp_cb is called only on first use
+-- and the cache is cleared when a new tmp_cb set
 -- @tparam string keytype, 'dh','ecdh',or 'rsa'
 -- @tparam function tmp_cb
 -- @param[opt] vararg
 function set_tmp() end
 
+--- set built-in RFC 7919 group as tmp dh parameters
+-- @tparam string keytype, must be 'dh'
+-- @tparam string group 'ffdhe2048', 'ffdhe3072', 'ffdhe4096', 'ffdhe6144' or 'ffdhe8192'
+function set_tmp() end
+
 --- set tmp key content pem format
 -- @tparam string keytype, 'dh','ecdh',or 'rsa'
 -- @tparam string key_pem
@@ -169,6 +186,163 @@ function verify_mode() end
 -- @treturn boolean result
 function set_verify() end
 
+--- replace servername index with hostname to ssl_ctx map, searched in C before
+-- the servername callback, which is only called on a miss.
+-- Names are case insensitive, '*.example.com' match one leftmost label like 'www.example.com'
+-- @tparam table map hostname as key and ssl_ctx as value
+-- @treturn number count of entries
+function sni_map() end
+
+--- get size of servername index
+-- @treturn number count of exact hostname entries
+-- @treturn number count of wildcard entries
+function sni_map() end
+
+--- add or replace one entry of servername index
+-- @tparam string hostname exact name or wildcard like '*.example.com'
+-- @tparam ssl_ctx ctx context to switch when hostname matched
+-- @treturn boolean result
+function sni_add() end
+
+--- remove one entry of servername index
+-- @tparam string hostname
+-- @treturn boolean true if hostname was in the index
+function sni_remove() end
+
+--- atomically replace certificate, private key and chain used by new handshakes,
+-- connections in progress and cached sessions are not affected, need OpenSSL 1.0.2 or later
+-- @tparam evp_pkey pkey private key match cert
+-- @tparam x509 cert certificate
+-- @tparam[opt] stack_of_x509 chain extra certificates send to peer
+-- @treturn boolean result, or nil followed by reason
+function swap_cert() end
+
+--- enable or disable cache of successful peer certificate verification.
+-- Cached chain skips chain building and signature checking until earliest notAfter
+-- or ttl expired, changing cert_store, verify_locations, set_verify, set_cert_verify
+-- or verify_depth drops all cached results, enable again also drops them.
+-- Any change made with x509_store methods, like adding a cert or crl, drops them too.
+-- When a lua verify callback is set, every chain goes to the callback and cache is bypassed
+-- @tparam boolean enable
+-- @tparam[opt=300] number ttl seconds to remember a verified chain
+-- @tparam[opt=1024] number max entries from 1 to 2^24, rounded up to power of 2
+-- @treturn boolean result
+function verify_cache() end
+
+--- get verification cache statistics
+-- @treturn number hits
+-- @treturn number misses
+function verify_cache() end
+
+--- enable hostname verification for connections of this ctx,
+-- ssl:set('hostname', name) then also does ssl:set_hostname_check(name), need OpenSSL 1.0.2 or later
+-- @tparam boolean enable
+-- @treturn boolean enabled
+function verify_hostname() end
+
+--- enable or disable telemetry counters, off by default,
+-- connections only carry counters while telemetry of their ctx is enabled
+-- @tparam[opt] boolean enable
+-- @treturn boolean enabled
+function telemetry() end
+
+--- get snapshot of telemetry counters, a connection is counted on the ctx it began handshake with
+-- @tparam[opt=false] boolean reset zero counters after the snapshot
+-- @treturn table counters with fields handshakes_started, handshakes_completed,
+-- handshakes_failed, resumptions, renegotiations, bytes_in, bytes_out, records_in, records_out,
+-- connections alive,
+-- handshake_ms array of 16 buckets, first under 1ms and bucket i under 2^(i-1) ms, last is open ended,
+-- alerts with sent and received tables indexed by alert description code,
+-- verify_errors indexed by X509_V_ERR code, codes out of range are counted at 0,
+-- nothing when telemetry was never enabled
+function stats() end
+
+--- enable or disable handshake tracing for new handshakes, see ssl:timings,
+-- enabling it also enables telemetry
+-- @tparam boolean enable
+-- @treturn boolean enabled
+function trace() end
+
+--- enable or disable low memory mode for connections made later,
+-- record buffers are released while empty and recycled through ctx freelist on OpenSSL 1.0.x
+-- @tparam boolean enable
+-- @tparam[opt] number freelist_max max buffers kept by freelist, OpenSSL 1.0.x only
+-- @treturn boolean enabled
+-- @treturn[opt] number freelist_max on OpenSSL 1.0.x
+function low_memory() end
+
+--- set session ticket key ring, so tickets issued by one process can be resumed by another.
+-- Each key is 48 bytes, 16 bytes key name, 16 bytes HMAC secret and 16 bytes AES key.
+-- The first key encrypts new tickets, any key decrypts, tickets of an older key are renewed
+-- @tparam table|string keys array of 48 bytes keys with current first,
+-- or path of a file holding the keys back to back
+-- @treturn number count of keys, or nil followed by reason
+function ticket_keys() end
+
+--- get count of session ticket keys
+-- @treturn number count
+function ticket_keys() end
+
+--- set ALPN protocols in preference order, need OpenSSL 1.0.2 or later.
+-- A server selects the first of them offered by client without lua callback, a client offers them
+-- @tparam table protocols like {'h2', 'http/1.1'}
+-- @treturn boolean result
+function alpn() end
+
+--- staple OCSP response for clients asking certificate status, handshakes only copy cached DER.
+-- Response is used until earliest nextUpdate, or one hour when it has none
+-- @tparam string der DER encoded OCSP response
+-- @treturn number time the staple expires, or nil followed by reason
+function ocsp_staple() end
+
+--- set OCSP provider, called now and by ocsp_refresh, ctx:swap_cert also calls it for new cert
+-- @tparam function provider return DER encoded OCSP response
+-- @treturn number time the staple expires, or nil followed by reason
+function ocsp_staple() end
+
+--- refresh stapled OCSP response by provider when missing or stale within margin,
+-- call it from a timer so provider never runs in handshakes
+-- @tparam[opt=300] number margin seconds before expire to refresh
+-- @treturn number time the staple expires, or nil followed by reason
+function ocsp_refresh() end
+
+--- set DTLS cookie secret and enable stateless cookie exchange used by ssl:dtls_listen,
+-- cookies are HMAC-SHA256 of peer address. Calling again rotates the secret,
+-- cookies made with previous secret still verify
+-- @tparam[opt] string secret random secret when omitted
+-- @treturn boolean result
+function dtls_cookie() end
+
+--- get or set max bytes of TLS 1.3 early data accepted by server, 0 disables it
+-- @tparam[opt] number size
+-- @treturn number current max early data
+function max_early_data() end
+
+--- protect early data against replay with in process bloom filters of ClientHello randoms,
+-- a random seen in last two windows rejects early data and the handshake falls back to 1-RTT.
+-- Installing filters or a store sets SSL_OP_NO_ANTI_REPLAY, tickets become reusable and
+-- these filters are the only replay protection. OpenSSL accepts early data whose ticket age
+-- is off by up to 10 seconds, so window must cover that skew and should be at least 10
+-- @tparam number bits size of each filter in bits
+-- @tparam[opt=10] number window seconds before filters rotate
+-- @treturn boolean result
+function anti_replay() end
+
+--- protect early data against replay with a custom store, such as one shared by servers,
+-- the store must remember a random for at least 10 seconds to cover ticket age skew
+-- @tparam function store called with client random, return true to accept early data
+-- @treturn boolean result
+function anti_replay() end
+
+--- remove replay filters or store, and restore OpenSSL single use tickets
+-- @tparam boolean false
+-- @treturn boolean result
+function anti_replay() end
+
+--- get count of early data rejected as replay by in process filters
+-- @treturn number
+function anti_replay() end
+
 --- create bio and ssl object
 -- @tparam string host_addr format like 'host:port'
 -- @tparam[opt=true] boolean server, true listen at host_addr,false connect to host_addr
@@ -264,6 +438,110 @@ function get() end
 -- @return value
 function set() end
 
+--- get kernel TLS offload state, only available with openssl built with ktls,
+-- enable it with ssl_ctx:options(ssl.enable_ktls) before handshake on a fd based ssl
+-- @treturn boolean send offload is active
+-- @treturn boolean receive offload is active
+function ktls() end
+
+--- verify peer certificate match host during handshake,
+-- host can be a DNS name checked against subjectAltName or CN, or an IP literal checked against iPAddress.
+-- Mismatch is a verification failure, fatal only when verify mode is 'peer', need OpenSSL 1.0.2 or later
+-- @tparam string host
+-- @treturn boolean result
+function set_hostname_check() end
+
+--- get telemetry counters of this connection, zero unless ctx:telemetry(true)
+-- @treturn table counters with fields handshakes, renegotiations, handshake_ms of last handshake,
+-- bytes_in, bytes_out, records_in, records_out
+function stats() end
+
+--- get handshake phase timings of last handshake, need ctx:trace(true) before handshake
+-- @treturn table with sent and received tables mapping message name like client_hello,
+-- server_hello, certificate, server_key_exchange, client_key_exchange or finished to milliseconds
+-- since handshake start, total handshake milliseconds and lua milliseconds spent in lua callbacks
+function timings() end
+
+--- get bytes of memory held by connection
+-- @treturn table with ext, total and on OpenSSL 1.0.x read_buffer, write_buffer, handshake_buffer
+function memory() end
+
+--- set ALPN protocols offered by this client connection, need OpenSSL 1.0.2 or later
+-- @tparam table protocols like {'h2', 'http/1.1'}
+-- @treturn boolean result
+function alpn() end
+
+--- get ALPN protocol selected by handshake
+-- @treturn string protocol or nil if none
+function alpn_selected() end
+
+--- request stapled OCSP response from server, call before handshake
+-- @tparam boolean request
+-- @treturn boolean result
+function ocsp_staple() end
+
+--- get stapled OCSP response sent by server
+-- @treturn string DER encoded OCSP response, or nil if none
+function ocsp_staple() end
+
+--- get time left on DTLS retransmit timer
+-- @treturn number seconds, or nil when no timer running
+function dtls_timeout() end
+
+--- retransmit DTLS handshake flight if timer expired, call when dtls_timeout reaches zero
+-- @treturn boolean true if retransmitted
+function handle_timeout() end
+
+--- wait for ClientHello with valid cookie on DTLS server, needs ctx:dtls_cookie,
+-- keeps no state for peers without cookie. Continue with handshake when return true.
+-- Cookies are bound to the peer address, so the bio must be a datagram bio
+-- @treturn boolean true, or false followed by 'want_read' on non-blocking bio
+-- @treturn string peer host, with OpenSSL 1.1.0 and later
+-- @treturn number peer port, with OpenSSL 1.1.0 and later
+function dtls_listen() end
+
+--- set DTLS path MTU and stop querying it from socket
+-- @tparam number mtu bytes
+-- @treturn boolean result
+function mtu() end
+
+--- client send TLS 1.3 early data before handshake completes, needs a resumable session
+-- @tparam string data
+-- @treturn number bytes written, or false followed by want_read/want_write to retry
+function write_early_data() end
+
+--- server read TLS 1.3 early data before handshake completes
+-- @tparam[opt=4096] number size max bytes to read
+-- @treturn string data, or false followed by 'finish' when no more early data
+function read_early_data() end
+
+--- get early data status of connection
+-- @treturn string 'accepted', 'rejected' or 'not_sent'
+function early_data_status() end
+
+--- read data from ssl connection and append to buffer
+-- @tparam buffer buf
+-- @tparam[opt] number size max bytes, default to spare capacity of buf
+-- @treturn number bytes appended, or nil followed by SSL_read result
+function read() end
+
+--- write data to ssl connection
+-- @tparam string|buffer data
+-- @treturn number bytes written, or false followed by want_read/want_write to retry
+function write() end
+
+--- send file content over ssl connection without making lua strings,
+-- use sendfile(2) when kernel TLS send offload is active, else pread chunks into SSL_write.
+-- When return want_read or want_write, call again with offset and length advanced by sent bytes.
+-- accept_moving_write_buffer mode is set only while the call runs, the mode of ssl is restored before return
+-- @tparam string|number path_or_fd file path or opened file descriptor
+-- @tparam[opt=0] number offset offset in file
+-- @tparam[opt] number length bytes to send, default to end of file
+-- @tparam[opt=16384] number chunk bytes per SSL_write
+-- @treturn number bytes sent
+-- @treturn[opt] string 'want_read' or 'want_write' if need retry, or reason when first value is nil
+function sendfile() end
+
 end
 
 end
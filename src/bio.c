@@ -8,6 +8,12 @@
 #include "openssl.h"
 #include "private.h"
 #include <openssl/ssl.h>
+#ifdef WIN32
+#include <winsock2.h>
+typedef int socklen_t;
+#else
+#include <sys/socket.h>
+#endif
 
 #define MYNAME    "bio"
 #define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
@@ -96,10 +102,34 @@ static LUA_FUNCTION(openssl_bio_new_dgram)
   int s = luaL_checkint(L, 1);
   int closeflag = luaL_checkoption(L, 2, "noclose", close_flags);
   BIO *bio = BIO_new_dgram(s, closeflag);
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
+
+  /* socket connected to a peer, send to it instead of a zero address */
+  if (bio && getpeername(s, (struct sockaddr*)&peer, &len) == 0)
+    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &peer);
   PUSH_OBJECT(bio, "openssl.bio");
   return 1;
 }
 
+static LUA_FUNCTION(openssl_bio_new_pair)
+{
+  int size1 = luaL_optint(L, 1, 0);
+  int size2 = luaL_optint(L, 2, size1);
+  BIO *b1 = NULL, *b2 = NULL;
+  int ret;
+  luaL_argcheck(L, size1 >= 0, 1, "must not be negative");
+  luaL_argcheck(L, size2 >= 0, 2, "must not be negative");
+  ret = BIO_new_bio_pair(&b1, size1, &b2, size2);
+  if (ret == 1)
+  {
+    PUSH_OBJECT(b1, "openssl.bio");
+    PUSH_OBJECT(b2, "openssl.bio");
+    return 2;
+  }
+  return openssl_pushresult(L, ret);
+}
+
 static LUA_FUNCTION(openssl_bio_new_fd)
 {
   int fd = luaL_checkint(L, 1);
@@ -238,10 +268,33 @@ static LUA_FUNCTION(openssl_bio_new_filter)
 static LUA_FUNCTION(openssl_bio_read)
 {
   BIO* bio = CHECK_OBJECT(1, BIO, "openssl.bio");
-  int len = luaL_optint(L, 2, BIO_pending(bio));
+  OPENSSL_BUFFER* ob = openssl_tobuffer(L, 2);
+  int len;
   char* buf = NULL;
   int ret = 1;
 
+  if (ob)
+  {
+    /* append to buffer, up to its spare capacity by default */
+    size_t spare = ob->cap - ob->len;
+    len = luaL_optint(L, 3, spare ? (int)spare : 4096);
+    luaL_argcheck(L, len > 0, 3, "must greater than 0");
+    if (!openssl_buffer_reserve(ob, ob->len + len))
+      return luaL_error(L, "alloc buffer fail");
+    len = BIO_read(bio, ob->data + ob->len, len);
+    if (len > 0)
+      ob->len += len;
+    if (len > 0 || BIO_should_retry(bio))
+    {
+      lua_pushinteger(L, len > 0 ? len : 0);
+      return 1;
+    }
+    lua_pushnil(L);
+    lua_pushinteger(L, len);
+    return 2;
+  }
+
+  len = luaL_optint(L, 2, BIO_pending(bio));
   len = len>0 ? len : 4096;
   buf = malloc(len);
   len = BIO_read(bio, buf, len);
@@ -297,7 +350,7 @@ static LUA_FUNCTION(openssl_bio_write)
 {
   BIO* bio = CHECK_OBJECT(1, BIO, "openssl.bio");
   size_t size = 0;
-  const char* d = luaL_checklstring(L, 2, &size);
+  const char* d = openssl_checklbuffer(L, 2, &size);
   int ret = 1;
   int len = luaL_optint(L, 3, size);
 
@@ -506,7 +559,6 @@ static LUA_FUNCTION(openssl_bio_get_ssl){
   {
     PUSH_OBJECT(ssl,"openssl.ssl");
     ssl->references++;
-    openssl_newvalue(L, ssl);
     return 1;
   }
   return 0;
@@ -683,6 +735,7 @@ static luaL_reg R[] =
   {"mem",     openssl_bio_new_mem    },
   {"socket",  openssl_bio_new_socket   },
   {"dgram",   openssl_bio_new_dgram    },
+  {"pair",    openssl_bio_new_pair     },
   {"fd",      openssl_bio_new_fd     },
   {"file",    openssl_bio_new_file   },
   {"filter",  openssl_bio_new_filter   },
@@ -0,0 +1,211 @@
+/*=========================================================================*\
+* buffer.c
+* mutable byte buffer for lua-openssl binding
+*
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+
+#include "openssl.h"
+#include "private.h"
+
+#define MYNAME    "buffer"
+#define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
+  "based on OpenSSL " SHLIB_VERSION_NUMBER
+
+OPENSSL_BUFFER* openssl_tobuffer(lua_State*L, int idx)
+{
+  if (auxiliar_isclass(L, "openssl.buffer", idx))
+    return CHECK_OBJECT(idx, OPENSSL_BUFFER, "openssl.buffer");
+  return NULL;
+}
+
+/* accept lua string or openssl.buffer as input without copy */
+const char* openssl_checklbuffer(lua_State*L, int idx, size_t *len)
+{
+  OPENSSL_BUFFER* b = openssl_tobuffer(L, idx);
+  if (b)
+  {
+    *len = b->len;
+    return b->data ? b->data : "";
+  }
+  return luaL_checklstring(L, idx, len);
+}
+
+/* grow capacity to at least cap, data pointer may change */
+int openssl_buffer_reserve(OPENSSL_BUFFER* b, size_t cap)
+{
+  if (cap > b->cap)
+  {
+    size_t n = b->cap ? b->cap : 64;
+    char* data;
+    while (n < cap)
+      n = n * 2 > n ? n * 2 : cap;
+    data = realloc(b->data, n);
+    if (data == NULL)
+      return 0;
+    b->data = data;
+    b->cap = n;
+  }
+  return 1;
+}
+
+static OPENSSL_BUFFER* openssl_buffer_push(lua_State*L, size_t cap)
+{
+  OPENSSL_BUFFER* b = calloc(1, sizeof(OPENSSL_BUFFER));
+  if (b == NULL || !openssl_buffer_reserve(b, cap))
+  {
+    free(b);
+    luaL_error(L, "alloc buffer fail");
+  }
+  PUSH_OBJECT(b, "openssl.buffer");
+  return b;
+}
+
+static LUA_FUNCTION(openssl_buffer_new)
+{
+  OPENSSL_BUFFER* b;
+  if (lua_type(L, 1) == LUA_TSTRING)
+  {
+    size_t len;
+    const char* data = lua_tolstring(L, 1, &len);
+    b = openssl_buffer_push(L, len);
+    memcpy(b->data, data, len);
+    b->len = len;
+  }
+  else
+  {
+    lua_Integer cap = luaL_optinteger(L, 1, 4096);
+    luaL_argcheck(L, cap >= 0, 1, "must not be negative");
+    b = openssl_buffer_push(L, (size_t)cap);
+  }
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_len)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  lua_pushinteger(L, b->len);
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_capacity)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  lua_pushinteger(L, b->cap);
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_reserve_lua)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  lua_Integer cap = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, cap >= 0, 2, "must not be negative");
+  if (!openssl_buffer_reserve(b, (size_t)cap))
+    return luaL_error(L, "alloc buffer fail");
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+/* set length, bytes beyond old length are zeroed */
+static LUA_FUNCTION(openssl_buffer_resize)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  lua_Integer len = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, len >= 0, 2, "must not be negative");
+  if (!openssl_buffer_reserve(b, (size_t)len))
+    return luaL_error(L, "alloc buffer fail");
+  if ((size_t)len > b->len)
+    memset(b->data + b->len, 0, (size_t)len - b->len);
+  b->len = (size_t)len;
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_clear)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  if (lua_toboolean(L, 2) && b->data)
+    OPENSSL_cleanse(b->data, b->cap);
+  b->len = 0;
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_append)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  size_t len;
+  const char* data = openssl_checklbuffer(L, 2, &len);
+  if (!openssl_buffer_reserve(b, b->len + len))
+    return luaL_error(L, "alloc buffer fail");
+  /* data may point into b itself */
+  if (openssl_tobuffer(L, 2) == b)
+    data = b->data;
+  memmove(b->data + b->len, data, len);
+  b->len += len;
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+/* make lua string of bytes i to j, same index rules as string.sub */
+static LUA_FUNCTION(openssl_buffer_tostring)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  lua_Integer len = (lua_Integer)b->len;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i = len + i + 1;
+  if (j < 0) j = len + j + 1;
+  if (i < 1) i = 1;
+  if (j > len) j = len;
+  if (i > j)
+    lua_pushliteral(L, "");
+  else
+    lua_pushlstring(L, b->data + i - 1, (size_t)(j - i + 1));
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_buffer_free)
+{
+  OPENSSL_BUFFER* b = CHECK_OBJECT(1, OPENSSL_BUFFER, "openssl.buffer");
+  free(b->data);
+  free(b);
+  return 0;
+}
+
+static luaL_Reg buffer_funs[] =
+{
+  {"len",         openssl_buffer_len},
+  {"capacity",    openssl_buffer_capacity},
+  {"reserve",     openssl_buffer_reserve_lua},
+  {"resize",      openssl_buffer_resize},
+  {"clear",       openssl_buffer_clear},
+  {"append",      openssl_buffer_append},
+  {"tostring",    openssl_buffer_tostring},
+
+  {"__len",       openssl_buffer_len},
+  {"__gc",        openssl_buffer_free},
+  {"__tostring",  auxiliar_tostring},
+
+  {NULL, NULL}
+};
+
+static const luaL_Reg R[] =
+{
+  {"new",         openssl_buffer_new},
+
+  {NULL,  NULL}
+};
+
+int luaopen_buffer(lua_State *L)
+{
+  auxiliar_newclass(L, "openssl.buffer", buffer_funs);
+
+  lua_newtable(L);
+  luaL_setfuncs(L, R, 0);
+  lua_pushliteral(L, "version");    /** version */
+  lua_pushliteral(L, MYVERSION);
+  lua_settable(L, -3);
+
+  return 1;
+}
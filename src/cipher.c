@@ -7,6 +7,9 @@
 
 #include "openssl.h"
 #include "private.h"
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #define MYNAME    "cipher"
 #define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
@@ -276,6 +279,657 @@ static LUA_FUNCTION(openssl_evp_cipher)
   return 0;
 }
 
+#ifndef EVP_CTRL_AEAD_SET_TAG
+#define EVP_CTRL_AEAD_SET_IVLEN EVP_CTRL_GCM_SET_IVLEN
+#define EVP_CTRL_AEAD_GET_TAG   EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG   EVP_CTRL_GCM_SET_TAG
+#endif
+
+/*
+ * Prepare c for one shot AEAD, CCM needs tag length (or tag to verify) and
+ * message length before aad, GCM and ChaCha20-Poly1305 take them any time.
+ * Arguments are checked before *pc is allocated, caller frees it.
+ */
+static int openssl_aead_init(lua_State *L, EVP_CIPHER_CTX **pc, const EVP_CIPHER *cipher, int enc,
+                             int tag_len, const char* tag, size_t data_len)
+{
+  EVP_CIPHER_CTX *c;
+  size_t key_len, nonce_len;
+  const char *key = luaL_checklstring(L, 2, &key_len);
+  const char *nonce = luaL_checklstring(L, 3, &nonce_len);
+  int ccm = EVP_CIPHER_mode(cipher) == EVP_CIPH_CCM_MODE;
+  int ret, outl;
+
+  luaL_argcheck(L, EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER, 1, "not an AEAD cipher");
+  luaL_argcheck(L, key_len == (size_t)EVP_CIPHER_key_length(cipher), 2, "invalid key length");
+  luaL_argcheck(L, tag_len > 0 && tag_len <= 16, 6, "invalid tag length");
+
+  *pc = c = EVP_CIPHER_CTX_new();
+  ret = EVP_CipherInit_ex(c, cipher, NULL, NULL, NULL, enc);
+  if (ret == 1 && nonce_len != (size_t)EVP_CIPHER_iv_length(cipher))
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_IVLEN, nonce_len, NULL);
+  if (ret == 1 && ccm)
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_TAG, tag_len, (void*)tag);
+  if (ret == 1)
+    ret = EVP_CipherInit_ex(c, NULL, NULL, (const byte*)key, (const byte*)nonce, enc);
+  if (ret == 1 && ccm)
+    ret = EVP_CipherUpdate(c, NULL, &outl, NULL, data_len);
+  return ret;
+}
+
+static LUA_FUNCTION(openssl_aead_seal)
+{
+  const EVP_CIPHER* cipher = get_cipher(L, 1, NULL);
+  size_t input_len, aad_len = 0;
+  const char *input = luaL_checklstring(L, 4, &input_len);
+  const char *aad = luaL_optlstring(L, 5, NULL, &aad_len);
+  int tag_len = luaL_optint(L, 6, 16);
+  EVP_CIPHER_CTX *c;
+  unsigned char tag[16];
+  char *buffer;
+  int ret, len, output_len = 0;
+
+  luaL_argcheck(L, cipher, 1, "invalid cipher algorithm or openssl.evp_cipher object");
+  ret = openssl_aead_init(L, &c, cipher, 1, tag_len, NULL, input_len);
+  if (ret == 1 && aad)
+    ret = EVP_EncryptUpdate(c, NULL, &len, (const byte*)aad, aad_len);
+  if (ret == 1)
+  {
+    buffer = OPENSSL_malloc(input_len + EVP_MAX_BLOCK_LENGTH);
+    ret = EVP_EncryptUpdate(c, (byte*)buffer, &len, (const byte*)input, input_len);
+    if (ret == 1)
+    {
+      output_len = len;
+      ret = EVP_EncryptFinal_ex(c, (byte*)buffer + output_len, &len);
+      if (ret == 1)
+      {
+        output_len += len;
+        ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_GET_TAG, tag_len, tag);
+      }
+      if (ret == 1)
+      {
+        lua_pushlstring(L, buffer, output_len);
+        lua_pushlstring(L, (const char*)tag, tag_len);
+      }
+    }
+    OPENSSL_free(buffer);
+  }
+  EVP_CIPHER_CTX_free(c);
+  return ret == 1 ? 2 : openssl_pushresult(L, ret);
+}
+
+static LUA_FUNCTION(openssl_aead_open)
+{
+  const EVP_CIPHER* cipher = get_cipher(L, 1, NULL);
+  size_t input_len, tag_len, aad_len = 0;
+  const char *input = luaL_checklstring(L, 4, &input_len);
+  const char *tag = luaL_checklstring(L, 5, &tag_len);
+  const char *aad = luaL_optlstring(L, 6, NULL, &aad_len);
+  int ccm = cipher && EVP_CIPHER_mode(cipher) == EVP_CIPH_CCM_MODE;
+  EVP_CIPHER_CTX *c;
+  char *buffer;
+  int ret, len, output_len = 0;
+
+  luaL_argcheck(L, cipher, 1, "invalid cipher algorithm or openssl.evp_cipher object");
+  luaL_argcheck(L, tag_len > 0 && tag_len <= 16, 5, "invalid tag length");
+  ret = openssl_aead_init(L, &c, cipher, 0, (int)tag_len, tag, input_len);
+  if (ret == 1 && !ccm)
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_TAG, tag_len, (void*)tag);
+  if (ret == 1 && aad)
+    ret = EVP_DecryptUpdate(c, NULL, &len, (const byte*)aad, aad_len);
+  if (ret == 1)
+  {
+    ERR_clear_error();
+    buffer = OPENSSL_malloc(input_len + EVP_MAX_BLOCK_LENGTH);
+    /* CCM verifies tag in update and has nothing to finalize */
+    ret = EVP_DecryptUpdate(c, (byte*)buffer, &len, (const byte*)input, input_len);
+    if (ret == 1)
+    {
+      output_len = len;
+      if (!ccm)
+      {
+        ret = EVP_DecryptFinal_ex(c, (byte*)buffer + output_len, &len);
+        output_len += len;
+      }
+    }
+    if (ret == 1)
+      lua_pushlstring(L, buffer, output_len);
+    OPENSSL_cleanse(buffer, input_len);
+    OPENSSL_free(buffer);
+    if (ret != 1 && ERR_peek_error() == 0)
+    {
+      EVP_CIPHER_CTX_free(c);
+      lua_pushnil(L);
+      lua_pushstring(L, "authentication failed");
+      return 2;
+    }
+  }
+  EVP_CIPHER_CTX_free(c);
+  return ret == 1 ? 1 : openssl_pushresult(L, ret);
+}
+
+/*
+ * Parallel CTR and GCM, input is split into block aligned chunks each
+ * encrypted from its own counter on a thread. For GCM every chunk also gets
+ * its GHASH, taken from the tag of an AAD only GCM pass over the chunk, and
+ * chunk hashes are combined by multiplying with powers of H.
+ */
+#define PARALLEL_MIN_CHUNK  (64 * 1024)
+#define PARALLEL_MAX_PIECE  (1 << 30)
+
+typedef struct
+{
+  uint64_t hi, lo;
+} GF128;
+
+static GF128 gf128_load(const unsigned char *b)
+{
+  GF128 r = {0, 0};
+  int i;
+  for (i = 0; i < 8; i++)
+  {
+    r.hi = (r.hi << 8) | b[i];
+    r.lo = (r.lo << 8) | b[i + 8];
+  }
+  return r;
+}
+
+static void gf128_store(GF128 x, unsigned char *b)
+{
+  int i;
+  for (i = 7; i >= 0; i--)
+  {
+    b[i] = (unsigned char)x.hi;
+    b[i + 8] = (unsigned char)x.lo;
+    x.hi >>= 8;
+    x.lo >>= 8;
+  }
+}
+
+/* multiply in GCM bit order, NIST SP 800-38D algorithm 1 */
+static GF128 gf128_mul(GF128 x, GF128 y)
+{
+  GF128 z = {0, 0}, v = y;
+  int i;
+  for (i = 0; i < 128; i++)
+  {
+    uint64_t bit = i < 64 ? (x.hi >> (63 - i)) & 1 : (x.lo >> (127 - i)) & 1;
+    uint64_t lsb = v.lo & 1;
+    if (bit)
+    {
+      z.hi ^= v.hi;
+      z.lo ^= v.lo;
+    }
+    v.lo = (v.lo >> 1) | (v.hi << 63);
+    v.hi >>= 1;
+    if (lsb)
+      v.hi ^= 0xE100000000000000ULL;
+  }
+  return z;
+}
+
+static GF128 gf128_pow(GF128 x, uint64_t n)
+{
+  GF128 r = {0x8000000000000000ULL, 0};
+  while (n)
+  {
+    if (n & 1)
+      r = gf128_mul(r, x);
+    x = gf128_mul(x, x);
+    n >>= 1;
+  }
+  return r;
+}
+
+/* x^(2^128-2), inverse of non zero x */
+static GF128 gf128_inv(GF128 x)
+{
+  GF128 r = {0x8000000000000000ULL, 0};
+  int i;
+  for (i = 0; i < 127; i++)
+    r = gf128_mul(gf128_mul(r, r), x);
+  return gf128_mul(r, r);
+}
+
+typedef struct
+{
+  const EVP_CIPHER *ctr;
+  const EVP_CIPHER *gcm;      /* NULL for plain CTR */
+  const unsigned char *key;
+  const unsigned char *nonce; /* 12 bytes for GCM */
+  unsigned char counter[16];
+  const unsigned char *in;
+  unsigned char *out;
+  size_t len;
+  int enc;
+  unsigned char tag[16];      /* tag of AAD only GCM over ciphertext */
+  int ok;
+} PARALLEL_JOB;
+
+static int parallel_ghash_tag(const EVP_CIPHER *gcm, const unsigned char *key, const unsigned char *nonce,
+                              const unsigned char *data, size_t len, unsigned char *tag)
+{
+  EVP_CIPHER_CTX *c = EVP_CIPHER_CTX_new();
+  unsigned char last[EVP_MAX_BLOCK_LENGTH];
+  int outl, ret = EVP_EncryptInit_ex(c, gcm, NULL, key, nonce);
+  while (ret == 1 && len > 0)
+  {
+    int n = len > PARALLEL_MAX_PIECE ? PARALLEL_MAX_PIECE : (int)len;
+    ret = EVP_EncryptUpdate(c, NULL, &outl, data, n);
+    data += n;
+    len -= n;
+  }
+  if (ret == 1)
+    ret = EVP_EncryptFinal_ex(c, last, &outl);
+  if (ret == 1)
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_GET_TAG, 16, tag);
+  EVP_CIPHER_CTX_free(c);
+  return ret == 1;
+}
+
+static void parallel_job_run(void *arg)
+{
+  PARALLEL_JOB *job = arg;
+  EVP_CIPHER_CTX *c;
+  const unsigned char *in = job->in;
+  unsigned char *out = job->out;
+  size_t len = job->len;
+  int outl, ret;
+
+  /* GHASH covers ciphertext, which is input when decrypting in place */
+  if (job->gcm && !job->enc
+      && !parallel_ghash_tag(job->gcm, job->key, job->nonce, job->in, job->len, job->tag))
+    return;
+
+  c = EVP_CIPHER_CTX_new();
+  ret = EVP_EncryptInit_ex(c, job->ctr, NULL, job->key, job->counter);
+  while (ret == 1 && len > 0)
+  {
+    int n = len > PARALLEL_MAX_PIECE ? PARALLEL_MAX_PIECE : (int)len;
+    ret = EVP_EncryptUpdate(c, out, &outl, in, n);
+    in += n;
+    out += n;
+    len -= n;
+  }
+  EVP_CIPHER_CTX_free(c);
+  if (ret != 1)
+    return;
+
+  if (job->gcm && job->enc
+      && !parallel_ghash_tag(job->gcm, job->key, job->nonce, job->out, job->len, job->tag))
+    return;
+  job->ok = 1;
+}
+
+static const EVP_CIPHER* parallel_ctr_cipher(int key_len)
+{
+  return key_len == 16 ? EVP_aes_128_ctr() : key_len == 24 ? EVP_aes_192_ctr()
+         : key_len == 32 ? EVP_aes_256_ctr() : NULL;
+}
+
+static const EVP_CIPHER* parallel_ecb_cipher(int key_len)
+{
+  return key_len == 16 ? EVP_aes_128_ecb() : key_len == 24 ? EVP_aes_192_ecb()
+         : key_len == 32 ? EVP_aes_256_ecb() : NULL;
+}
+
+/* E(K, block) */
+static int parallel_ecb_block(int key_len, const unsigned char *key, const unsigned char *in, unsigned char *out)
+{
+  EVP_CIPHER_CTX *c = EVP_CIPHER_CTX_new();
+  int outl, ret = EVP_EncryptInit_ex(c, parallel_ecb_cipher(key_len), NULL, key, NULL);
+  if (ret == 1)
+    ret = EVP_CIPHER_CTX_set_padding(c, 0);
+  if (ret == 1)
+    ret = EVP_EncryptUpdate(c, out, &outl, in, 16);
+  EVP_CIPHER_CTX_free(c);
+  return ret == 1;
+}
+
+/* add n to 128 bits big endian counter */
+static void parallel_counter_add(unsigned char *counter, uint64_t n)
+{
+  int i;
+  for (i = 15; i >= 0 && n; i--)
+  {
+    n += counter[i];
+    counter[i] = (unsigned char)n;
+    n >>= 8;
+  }
+}
+
+/* combine chunk tags and aad into final GCM tag */
+static int parallel_gcm_tag(const EVP_CIPHER *gcm, int key_len, const unsigned char *key,
+                            const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+                            PARALLEL_JOB *jobs, int n, size_t len, unsigned char *tag)
+{
+  unsigned char block[16] = {0};
+  GF128 h, hinv, s, x, t;
+  uint64_t after = (len + 15) / 16;
+  int i;
+
+  if (!parallel_ecb_block(key_len, key, block, block))
+    return 0;
+  h = gf128_load(block);
+  hinv = gf128_inv(h);
+  memcpy(block, nonce, 12);
+  block[12] = block[13] = block[14] = 0;
+  block[15] = 1;
+  if (!parallel_ecb_block(key_len, key, block, block))
+    return 0;
+  s = gf128_load(block);
+
+  /* GHASH of chunk alone is (T ^ S) * H^-1 ^ L, L is its AAD length block */
+  x.hi = x.lo = 0;
+  if (aad_len > 0)
+  {
+    if (!parallel_ghash_tag(gcm, key, nonce, aad, aad_len, block))
+      return 0;
+    t = gf128_load(block);
+    t.hi ^= s.hi;
+    t.lo ^= s.lo;
+    x = gf128_mul(t, hinv);
+    x.hi ^= (uint64_t)aad_len * 8;
+    x = gf128_mul(x, gf128_pow(h, after));
+  }
+  for (i = 0; i < n; i++)
+  {
+    GF128 y;
+    after -= (jobs[i].len + 15) / 16;
+    t = gf128_load(jobs[i].tag);
+    t.hi ^= s.hi;
+    t.lo ^= s.lo;
+    y = gf128_mul(t, hinv);
+    y.hi ^= (uint64_t)jobs[i].len * 8;
+    y = gf128_mul(y, gf128_pow(h, after));
+    x.hi ^= y.hi;
+    x.lo ^= y.lo;
+  }
+  x.hi ^= (uint64_t)aad_len * 8;
+  x.lo ^= (uint64_t)len * 8;
+  x = gf128_mul(x, h);
+  x.hi ^= s.hi;
+  x.lo ^= s.lo;
+  gf128_store(x, tag);
+  return 1;
+}
+
+static int openssl_evp_parallel(lua_State *L, int enc)
+{
+  const EVP_CIPHER* cipher = get_cipher(L, 1, NULL);
+  size_t key_len, iv_len, len, aad_len = 0, tag_len = 16, expect_len = 0;
+  const char *key = luaL_checklstring(L, 2, &key_len);
+  const char *iv = luaL_checklstring(L, 3, &iv_len);
+  const char *in = openssl_checklbuffer(L, 4, &len);
+  OPENSSL_BUFFER *ob = openssl_tobuffer(L, 4);
+  const char *aad = NULL, *expect = NULL;
+  int threads = openssl_cpu_count();
+  int gcm, mode, i, n, ok = 1;
+  size_t chunk, off;
+  unsigned char *out;
+  unsigned char tag[16];
+  PARALLEL_JOB *jobs;
+
+  luaL_argcheck(L, cipher, 1, "invalid cipher algorithm or openssl.evp_cipher object");
+  mode = EVP_CIPHER_mode(cipher);
+  gcm = mode == EVP_CIPH_GCM_MODE;
+  luaL_argcheck(L, (gcm || mode == EVP_CIPH_CTR_MODE) && parallel_ctr_cipher(key_len)
+                && key_len == (size_t)EVP_CIPHER_key_length(cipher), 1, "only AES CTR and GCM supported");
+  luaL_argcheck(L, iv_len == (gcm ? 12 : 16), 3, gcm ? "GCM nonce must be 12 bytes" : "CTR iv must be 16 bytes");
+  luaL_argcheck(L, !gcm || len / 16 < 0xFFFFFFFEUL, 4, "too long for GCM");
+
+  if (lua_istable(L, 5))
+  {
+    lua_getfield(L, 5, "threads");
+    threads = luaL_optint(L, -1, threads);
+    lua_getfield(L, 5, "aad");
+    aad = luaL_optlstring(L, -1, NULL, &aad_len);
+    lua_getfield(L, 5, "taglen");
+    tag_len = luaL_optint(L, -1, 16);
+    lua_getfield(L, 5, "tag");
+    expect = luaL_optlstring(L, -1, NULL, &expect_len);
+    if (expect)
+      tag_len = expect_len;
+    /* aad and tag strings stay referenced by the table */
+    lua_pop(L, 4);
+  }
+  luaL_argcheck(L, threads > 0, 5, "threads must greater than 0");
+  luaL_argcheck(L, tag_len > 0 && tag_len <= 16, 5, "invalid tag length");
+  luaL_argcheck(L, !gcm || enc || expect, 5, "tag required to decrypt GCM");
+
+  /* chunks are block aligned, and not smaller than PARALLEL_MIN_CHUNK */
+  n = (int)((len + PARALLEL_MIN_CHUNK - 1) / PARALLEL_MIN_CHUNK);
+  n = n < threads ? n : threads;
+  n = n > 0 ? n : 1;
+  chunk = ((len + n - 1) / n + 15) / 16 * 16;
+
+  /* an empty buffer has no data, that is not an alloc failure */
+  out = ob ? (unsigned char*)ob->data : malloc(len ? len : 1);
+  jobs = calloc(n, sizeof(PARALLEL_JOB));
+  if ((!ob && !out) || !jobs)
+  {
+    if (!ob)
+      free(out);
+    free(jobs);
+    return luaL_error(L, "alloc parallel jobs fail");
+  }
+
+  for (i = 0, off = 0; i < n; i++, off += chunk)
+  {
+    PARALLEL_JOB *job = &jobs[i];
+    job->ctr = parallel_ctr_cipher(key_len);
+    job->gcm = gcm ? cipher : NULL;
+    job->key = (const unsigned char*)key;
+    job->nonce = (const unsigned char*)iv;
+    job->enc = enc;
+    if (gcm)
+    {
+      memcpy(job->counter, iv, 12);
+      job->counter[15] = 2;
+    }
+    else
+      memcpy(job->counter, iv, 16);
+    parallel_counter_add(job->counter, off / 16);
+    job->in = (const unsigned char*)in + (off < len ? off : len);
+    job->out = out + (off < len ? off : len);
+    job->len = off >= len ? 0 : len - off < chunk ? len - off : chunk;
+  }
+
+  openssl_parallel_run(parallel_job_run, jobs, sizeof(PARALLEL_JOB), n);
+
+  for (i = 0; i < n; i++)
+    ok = ok && jobs[i].ok;
+  if (ok && gcm)
+    ok = parallel_gcm_tag(cipher, (int)key_len, (const unsigned char*)key, (const unsigned char*)iv,
+                          (const unsigned char*)aad, aad_len, jobs, n, len, tag);
+  free(jobs);
+
+  if (ok && gcm && !enc && CRYPTO_memcmp(tag, expect, tag_len) != 0)
+  {
+    OPENSSL_cleanse(out, len);
+    if (ob)
+      ob->len = 0;
+    else
+      free(out);
+    lua_pushnil(L);
+    lua_pushstring(L, "authentication failed");
+    return 2;
+  }
+  if (!ok)
+  {
+    if (!ob)
+      free(out);
+    return openssl_pushresult(L, 0);
+  }
+
+  if (ob)
+    lua_pushvalue(L, 4);
+  else
+  {
+    lua_pushlstring(L, (const char*)out, len);
+    free(out);
+  }
+  if (gcm && enc)
+  {
+    lua_pushlstring(L, (const char*)tag, tag_len);
+    return 2;
+  }
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_evp_encrypt_parallel)
+{
+  return openssl_evp_parallel(L, 1);
+}
+
+static LUA_FUNCTION(openssl_evp_decrypt_parallel)
+{
+  return openssl_evp_parallel(L, 0);
+}
+
+typedef struct
+{
+  EVP_CIPHER_CTX *c;
+  FILE *out;
+  unsigned char *buf;
+  double total;
+} CIPHER_FILE;
+
+static int cipher_file_chunk(void *arg, const unsigned char *data, size_t len)
+{
+  CIPHER_FILE *cf = arg;
+  while (len > 0)
+  {
+    int n = len > OPENSSL_FILE_CHUNK ? OPENSSL_FILE_CHUNK : (int)len;
+    int outl;
+    if (EVP_CipherUpdate(cf->c, cf->buf, &outl, data, n) != 1
+        || fwrite(cf->buf, 1, outl, cf->out) != (size_t)outl)
+      return 0;
+    cf->total += outl;
+    data += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* 1 when a and b name the same existing file */
+static int cipher_same_file(const char* a, const char* b)
+{
+#ifdef WIN32
+  char fa[_MAX_PATH], fb[_MAX_PATH];
+  return _fullpath(fa, a, sizeof(fa)) && _fullpath(fb, b, sizeof(fb))
+         && _stricmp(fa, fb) == 0;
+#else
+  struct stat sa, sb;
+  return stat(a, &sa) == 0 && stat(b, &sb) == 0
+         && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+}
+
+/*
+ * Stream in_path through cipher to out_path with constant memory, AEAD
+ * ciphers return tag when encrypt and need it when decrypt.
+ */
+static int openssl_evp_cipher_file(lua_State *L, int enc)
+{
+  const EVP_CIPHER* cipher = get_cipher(L, 1, NULL);
+  size_t key_len, iv_len = 0, tag_len = 0;
+  const char *key = luaL_checklstring(L, 2, &key_len);
+  const char *iv = luaL_optlstring(L, 3, NULL, &iv_len);
+  const char *in = luaL_checkstring(L, 4);
+  const char *out = luaL_checkstring(L, 5);
+  const char *tag = enc ? NULL : luaL_optlstring(L, 6, NULL, &tag_len);
+  int aead, outl, ret;
+  unsigned char etag[16];
+  char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+  CIPHER_FILE cf;
+  struct stat st;
+
+  luaL_argcheck(L, cipher, 1, "invalid cipher algorithm or openssl.evp_cipher object");
+  luaL_argcheck(L, key_len == (size_t)EVP_CIPHER_key_length(cipher), 2, "invalid key length");
+  aead = (EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+  luaL_argcheck(L, !aead || EVP_CIPHER_mode(cipher) != EVP_CIPH_CCM_MODE, 1, "CCM can not stream");
+  luaL_argcheck(L, enc || !aead || (tag && tag_len > 0 && tag_len <= 16), 6, "tag required to decrypt AEAD");
+
+  luaL_argcheck(L, iv_len <= EVP_MAX_IV_LENGTH, 3, "iv too long");
+  if (iv)
+    memcpy(evp_iv, iv, iv_len);
+
+  /* check input before out_path is truncated, output over input loses it */
+  if (stat(in, &st) != 0)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  luaL_argcheck(L, !cipher_same_file(in, out), 5, "same file as input");
+
+  errno = 0;
+  memset(&cf, 0, sizeof(cf));
+  cf.buf = malloc(OPENSSL_FILE_CHUNK + EVP_MAX_BLOCK_LENGTH);
+  cf.out = fopen(out, "wb");
+  cf.c = EVP_CIPHER_CTX_new();
+  ret = cf.buf && cf.out && cf.c;
+  if (ret)
+    ret = EVP_CipherInit_ex(cf.c, cipher, NULL, NULL, NULL, enc) == 1;
+  if (ret && aead && iv && iv_len != (size_t)EVP_CIPHER_iv_length(cipher))
+    ret = EVP_CIPHER_CTX_ctrl(cf.c, EVP_CTRL_AEAD_SET_IVLEN, iv_len, NULL) == 1;
+  if (ret)
+    ret = EVP_CipherInit_ex(cf.c, NULL, NULL, (const byte*)key, iv ? (const byte*)evp_iv : NULL, enc) == 1;
+  if (ret && aead && !enc)
+    ret = EVP_CIPHER_CTX_ctrl(cf.c, EVP_CTRL_AEAD_SET_TAG, tag_len, (void*)tag) == 1;
+  if (ret)
+    ret = openssl_file_foreach(in, OPENSSL_FILE_CHUNK, cipher_file_chunk, &cf);
+  if (ret)
+    ret = EVP_CipherFinal_ex(cf.c, cf.buf, &outl) == 1
+          && fwrite(cf.buf, 1, outl, cf.out) == (size_t)outl;
+  if (ret)
+    cf.total += outl;
+  if (ret && aead && enc)
+    ret = EVP_CIPHER_CTX_ctrl(cf.c, EVP_CTRL_AEAD_GET_TAG, 16, etag) == 1;
+
+  if (cf.out && fclose(cf.out) != 0)
+    ret = 0;
+  if (cf.c)
+    EVP_CIPHER_CTX_free(cf.c);
+  if (cf.buf)
+  {
+    OPENSSL_cleanse(cf.buf, OPENSSL_FILE_CHUNK + EVP_MAX_BLOCK_LENGTH);
+    free(cf.buf);
+  }
+
+  if (!ret)
+  {
+    /* never leave partial or unauthenticated output */
+    if (cf.out)
+      remove(out);
+    if (ERR_peek_error() == 0)
+    {
+      lua_pushnil(L);
+      lua_pushstring(L, errno ? strerror(errno) : "cipher file fail");
+      return 2;
+    }
+    return openssl_pushresult(L, 0);
+  }
+  lua_pushnumber(L, cf.total);
+  if (aead && enc)
+  {
+    lua_pushlstring(L, (const char*)etag, 16);
+    return 2;
+  }
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_evp_encrypt_file)
+{
+  return openssl_evp_cipher_file(L, 1);
+}
+
+static LUA_FUNCTION(openssl_evp_decrypt_file)
+{
+  return openssl_evp_cipher_file(L, 0);
+}
+
 typedef enum
 {
   DO_CIPHER = -1,
@@ -464,12 +1118,36 @@ static LUA_FUNCTION(openssl_evp_cipher_update)
 {
   EVP_CIPHER_CTX* c = CHECK_OBJECT(1, EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
   size_t inl;
-  const char* in = luaL_checklstring(L, 2, &inl);
+  const char* in = openssl_checklbuffer(L, 2, &inl);
+  OPENSSL_BUFFER* ob = openssl_tobuffer(L, 3);
   int outl = inl + EVP_MAX_BLOCK_LENGTH;
-  char* out = OPENSSL_malloc(outl);
+  char* out;
+  char* scratch = NULL;
   CIPHER_MODE mode;
   int ret;
 
+  /* output replaces content of buffer, which may be input buffer itself */
+  if (ob)
+  {
+    if (!openssl_buffer_reserve(ob, outl))
+      return luaL_error(L, "alloc buffer fail");
+    in = openssl_checklbuffer(L, 2, &inl);
+    out = ob->data;
+    /*
+     * block modes first write a block held from previous update, which is
+     * ahead of input read, so work aside and copy back
+     */
+    if (in == out && EVP_CIPHER_CTX_block_size(c) > 1)
+    {
+      scratch = OPENSSL_malloc(outl);
+      if (!scratch)
+        return luaL_error(L, "alloc buffer fail");
+      out = scratch;
+    }
+  }
+  else
+    out = OPENSSL_malloc(outl);
+
   lua_rawgetp(L,LUA_REGISTRYINDEX,c);
   mode = lua_tointeger(L, -1);
 
@@ -483,12 +1161,28 @@ static LUA_FUNCTION(openssl_evp_cipher_update)
     luaL_error(L, "never go here");
   lua_pop(L, 1);
 
-  if (ret==1)
+  if (ob)
   {
-    lua_pushlstring(L, out, outl);
+    if (ret==1)
+    {
+      if (scratch)
+        memcpy(ob->data, scratch, outl);
+      ob->len = outl;
+      lua_pushinteger(L, outl);
+    }
+    if (scratch)
+    {
+      OPENSSL_cleanse(scratch, outl);
+      OPENSSL_free(scratch);
+    }
   }
-  OPENSSL_free(out);
-  
+  else
+  {
+    if (ret==1)
+      lua_pushlstring(L, out, outl);
+    OPENSSL_free(out);
+  }
+
   return (ret==1 ? 1 : openssl_pushresult(L,ret));
 }
 
@@ -515,13 +1209,106 @@ static LUA_FUNCTION(openssl_evp_cipher_final)
 
   if (ret == 1)
   {
-    lua_pushlstring(L, out, outl);
+    OPENSSL_BUFFER* ob = openssl_tobuffer(L, 2);
+    if (ob)
+    {
+      /* append to buffer holding output of update */
+      if (!openssl_buffer_reserve(ob, ob->len + outl))
+        return luaL_error(L, "alloc buffer fail");
+      memcpy(ob->data + ob->len, out, outl);
+      ob->len += outl;
+      lua_pushinteger(L, outl);
+    }
+    else
+      lua_pushlstring(L, out, outl);
     return 1;
   }
   return openssl_pushresult(L, ret);
 }
 
 
+/*
+ * CCM takes tag length before key, expected tag before data and message
+ * length before aad, none of which a streaming ctx can provide in order.
+ */
+#define CHECK_NOT_CCM(L, c) \
+  luaL_argcheck(L, EVP_CIPHER_CTX_mode(c) != EVP_CIPH_CCM_MODE, 1, "CCM can not stream, use seal or open")
+
+/* feed additional authenticated data, before any update of data */
+static LUA_FUNCTION(openssl_evp_cipher_aad)
+{
+  EVP_CIPHER_CTX* c = CHECK_OBJECT(1, EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+  size_t aadl;
+  const char* aad = luaL_checklstring(L, 2, &aadl);
+  int outl, ret;
+
+  CHECK_NOT_CCM(L, c);
+  ret = EVP_CipherUpdate(c, NULL, &outl, (const byte*)aad, aadl);
+  return openssl_pushresult(L, ret);
+}
+
+/* get tag after final when encrypt, or set expected tag before final when decrypt */
+static LUA_FUNCTION(openssl_evp_cipher_tag)
+{
+  EVP_CIPHER_CTX* c = CHECK_OBJECT(1, EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+  int ret;
+  CHECK_NOT_CCM(L, c);
+  if (lua_type(L, 2) == LUA_TSTRING)
+  {
+    size_t tagl;
+    const char* tag = lua_tolstring(L, 2, &tagl);
+    luaL_argcheck(L, tagl > 0 && tagl <= 16, 2, "invalid tag length");
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_TAG, tagl, (void*)tag);
+    return openssl_pushresult(L, ret);
+  }
+  else
+  {
+    unsigned char tag[16];
+    int tagl = luaL_optint(L, 2, 16);
+    luaL_argcheck(L, tagl > 0 && tagl <= 16, 2, "invalid tag length");
+    ret = EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_GET_TAG, tagl, tag);
+    if (ret == 1)
+    {
+      lua_pushlstring(L, (const char*)tag, tagl);
+      return 1;
+    }
+    return openssl_pushresult(L, ret);
+  }
+}
+
+/* reinit with new iv, and key if given, reuse ctx and key schedule */
+static LUA_FUNCTION(openssl_evp_cipher_reset)
+{
+  EVP_CIPHER_CTX* c = CHECK_OBJECT(1, EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
+  size_t iv_len = 0, key_len = 0;
+  const char *iv = luaL_optlstring(L, 2, NULL, &iv_len);
+  const char *key = luaL_optlstring(L, 3, NULL, &key_len);
+  char evp_key[EVP_MAX_KEY_LENGTH] = {0};
+  char evp_iv[EVP_MAX_IV_LENGTH] = {0};
+  CIPHER_MODE mode;
+  int enc, ret;
+
+  lua_rawgetp(L, LUA_REGISTRYINDEX, c);
+  mode = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  enc = mode == DO_ENCRYPT ? 1 : mode == DO_DECRYPT ? 0 : -1;
+
+  if (key)
+  {
+    key_len = EVP_MAX_KEY_LENGTH > key_len ? key_len : EVP_MAX_KEY_LENGTH;
+    memcpy(evp_key, key, key_len);
+  }
+  if (iv)
+  {
+    iv_len = EVP_MAX_IV_LENGTH > iv_len ? iv_len : EVP_MAX_IV_LENGTH;
+    memcpy(evp_iv, iv, iv_len);
+  }
+  ret = EVP_CipherInit_ex(c, NULL, NULL, key ? (const byte*)evp_key : NULL,
+                          iv ? (const byte*)evp_iv : NULL, enc);
+  OPENSSL_cleanse(evp_key, sizeof(evp_key));
+  return openssl_pushresult(L, ret);
+}
+
 static LUA_FUNCTION(openssl_cipher_ctx_info)
 {
   EVP_CIPHER_CTX *ctx = CHECK_OBJECT(1, EVP_CIPHER_CTX, "openssl.evp_cipher_ctx");
@@ -560,6 +1347,12 @@ static luaL_Reg cipher_funs[] =
   {"encrypt",     openssl_evp_encrypt },
   {"decrypt",     openssl_evp_decrypt },
   {"cipher",      openssl_evp_cipher },
+  {"seal",        openssl_aead_seal },
+  {"open",        openssl_aead_open },
+  {"encrypt_parallel", openssl_evp_encrypt_parallel },
+  {"decrypt_parallel", openssl_evp_decrypt_parallel },
+  {"encrypt_file", openssl_evp_encrypt_file },
+  {"decrypt_file", openssl_evp_decrypt_file },
 
   {"__tostring",  auxiliar_tostring},
 
@@ -570,6 +1363,9 @@ static luaL_Reg cipher_ctx_funs[] =
 {
   {"update",      openssl_evp_cipher_update},
   {"final",       openssl_evp_cipher_final},
+  {"aad",         openssl_evp_cipher_aad},
+  {"tag",         openssl_evp_cipher_tag},
+  {"reset",       openssl_evp_cipher_reset},
 
   {"info",        openssl_cipher_ctx_info},
   {"__gc",        openssl_cipher_ctx_free},
@@ -586,6 +1382,12 @@ static const luaL_Reg R[] =
   { "encrypt", openssl_evp_encrypt},
   { "decrypt", openssl_evp_decrypt},
   { "cipher",  openssl_evp_cipher},
+  { "seal",    openssl_aead_seal},
+  { "open",    openssl_aead_open},
+  { "encrypt_parallel", openssl_evp_encrypt_parallel},
+  { "decrypt_parallel", openssl_evp_decrypt_parallel},
+  { "encrypt_file", openssl_evp_encrypt_file},
+  { "decrypt_file", openssl_evp_decrypt_file},
 
   { "new",     openssl_cipher_new},
   { "encrypt_new", openssl_cipher_encrypt_new},
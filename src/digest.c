@@ -7,6 +7,8 @@
 
 #include "openssl.h"
 #include "private.h"
+#include <errno.h>
+#include <stdint.h>
 
 #define MYNAME    "digest"
 #define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
@@ -124,6 +126,54 @@ static LUA_FUNCTION(openssl_digest_digest)
   return 1;
 }
 
+/* push digest value as binary string when raw, else as lowercase hex */
+static void digest_push(lua_State *L, const unsigned char *md, unsigned int len, int raw)
+{
+  if (raw)
+    lua_pushlstring(L, (const char*)md, len);
+  else
+  {
+    char hex[2*EVP_MAX_MD_SIZE+1];
+    to_hex((const char*)md, len, hex);
+    lua_pushstring(L, hex);
+  }
+}
+
+static int digest_file_chunk(void *arg, const unsigned char *data, size_t len)
+{
+  return EVP_DigestUpdate((EVP_MD_CTX*)arg, data, len) == 1;
+}
+
+/* digest file content with constant memory, hex result unless raw */
+static LUA_FUNCTION(openssl_digest_file)
+{
+  const EVP_MD *md = get_digest(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int raw = lua_toboolean(L, 3);
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  unsigned char buf[EVP_MAX_MD_SIZE];
+  unsigned int blen = sizeof(buf);
+  int ret;
+
+  errno = 0;
+  ret = EVP_DigestInit_ex(ctx, md, NULL) == 1
+        && openssl_file_foreach(path, OPENSSL_FILE_CHUNK, digest_file_chunk, ctx)
+        && EVP_DigestFinal_ex(ctx, buf, &blen) == 1;
+  EVP_MD_CTX_destroy(ctx);
+  if (!ret)
+  {
+    if (errno)
+    {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", path, strerror(errno));
+      return 2;
+    }
+    return openssl_pushresult(L, 0);
+  }
+  digest_push(L, buf, blen, raw);
+  return 1;
+}
+
 static LUA_FUNCTION(openssl_digest_info)
 {
   EVP_MD *md = CHECK_OBJECT(1, EVP_MD, "openssl.evp_digest");
@@ -178,7 +228,7 @@ static LUA_FUNCTION(openssl_evp_digest_update)
 {
   size_t inl;
   EVP_MD_CTX* c = CHECK_OBJECT(1, EVP_MD_CTX, "openssl.evp_digest_ctx");
-  const char* in = luaL_checklstring(L, 2, &inl);
+  const char* in = openssl_checklbuffer(L, 2, &inl);
 
   int ret = EVP_DigestUpdate(c, in, inl);
 
@@ -281,11 +331,468 @@ static LUA_FUNCTION(openssl_digest_ctx_clone)
 }
 
 
+/*
+ * Several digests over one pass of input, data is fed in cache sized
+ * slices to every context in turn so each slice is read from memory once.
+ */
+#define DIGEST_MULTI_MAX    16
+#define DIGEST_MULTI_SLICE  (32 * 1024)
+
+typedef struct
+{
+  int n;
+  EVP_MD_CTX *ctx[DIGEST_MULTI_MAX];
+} DIGEST_MULTI;
+
+static void digest_multi_free(DIGEST_MULTI *m)
+{
+  int i;
+  for (i = 0; i < m->n; i++)
+    EVP_MD_CTX_destroy(m->ctx[i]);
+  free(m);
+}
+
+static DIGEST_MULTI* digest_multi_create(lua_State *L, int idx)
+{
+  DIGEST_MULTI *m;
+  int i, n;
+
+  luaL_checktable(L, idx);
+  n = (int)lua_rawlen(L, idx);
+  luaL_argcheck(L, n > 0 && n <= DIGEST_MULTI_MAX, idx, "need 1 to 16 digest algs");
+  m = calloc(1, sizeof(DIGEST_MULTI));
+  if (m == NULL)
+    luaL_error(L, "alloc digest multi fail");
+  for (i = 0; i < n; i++)
+  {
+    const EVP_MD *md;
+    lua_rawgeti(L, idx, i + 1);
+    md = lua_isstring(L, -1) ? EVP_get_digestbyname(lua_tostring(L, -1))
+         : auxiliar_isclass(L, "openssl.evp_digest", -1) ? CHECK_OBJECT(-1, EVP_MD, "openssl.evp_digest") : NULL;
+    lua_pop(L, 1);
+    m->ctx[i] = md ? EVP_MD_CTX_create() : NULL;
+    if (m->ctx[i] == NULL || EVP_DigestInit_ex(m->ctx[i], md, NULL) != 1)
+    {
+      if (m->ctx[i])
+        m->n = i + 1;
+      digest_multi_free(m);
+      luaL_argerror(L, idx, "invalid digest alg");
+    }
+    m->n = i + 1;
+  }
+  return m;
+}
+
+static int digest_multi_update(void *arg, const unsigned char *data, size_t len)
+{
+  DIGEST_MULTI *m = arg;
+  while (len > 0)
+  {
+    size_t n = len > DIGEST_MULTI_SLICE ? DIGEST_MULTI_SLICE : len;
+    int i;
+    for (i = 0; i < m->n; i++)
+    {
+      if (EVP_DigestUpdate(m->ctx[i], data, n) != 1)
+        return 0;
+    }
+    data += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* push result of every digest, contexts are left usable to continue */
+static int digest_multi_push(lua_State *L, DIGEST_MULTI *m, int raw)
+{
+  EVP_MD_CTX *d = EVP_MD_CTX_create();
+  int i;
+  for (i = 0; i < m->n; i++)
+  {
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int blen = sizeof(buf);
+    if (EVP_MD_CTX_copy_ex(d, m->ctx[i]) != 1 || EVP_DigestFinal_ex(d, buf, &blen) != 1)
+    {
+      EVP_MD_CTX_destroy(d);
+      lua_pop(L, i);
+      return openssl_pushresult(L, 0);
+    }
+    digest_push(L, buf, blen, raw);
+  }
+  EVP_MD_CTX_destroy(d);
+  return m->n;
+}
+
+/* feed string, buffer, bio until eof, or lua file handle until eof */
+static int digest_multi_feed(lua_State *L, DIGEST_MULTI *m, int idx)
+{
+  void *fh = luaL_testudata(L, idx, LUA_FILEHANDLE);
+  FILE *fp = NULL;
+  BIO *bio = NULL;
+  unsigned char *buf;
+  int ret = 1;
+
+  if (fh == NULL && !auxiliar_isclass(L, "openssl.bio", idx))
+  {
+    size_t len;
+    const char *data = openssl_checklbuffer(L, idx, &len);
+    return digest_multi_update(m, (const unsigned char*)data, len);
+  }
+
+  /* check arguments before buffer is allocated, errors do not return */
+  if (fh)
+  {
+    /* FILE* is first member of lua file handle in every version */
+    fp = *(FILE**)fh;
+    luaL_argcheck(L, fp != NULL, idx, "attempt to use a closed file");
+  }
+  else
+    bio = CHECK_OBJECT(idx, BIO, "openssl.bio");
+
+  buf = malloc(DIGEST_MULTI_SLICE);
+  if (buf == NULL)
+    return 0;
+  if (fp)
+  {
+    size_t n;
+    while (ret && (n = fread(buf, 1, DIGEST_MULTI_SLICE, fp)) > 0)
+      ret = digest_multi_update(m, buf, n);
+    if (ret && ferror(fp))
+      ret = 0;
+  }
+  else
+  {
+    int n;
+    while (ret && (n = BIO_read(bio, buf, DIGEST_MULTI_SLICE)) > 0)
+      ret = digest_multi_update(m, buf, n);
+    /* empty non-blocking or memory bio reads as end of data */
+    if (ret && n < 0 && !BIO_should_retry(bio))
+      ret = 0;
+  }
+  free(buf);
+  return ret;
+}
+
+static LUA_FUNCTION(openssl_digest_multi)
+{
+  DIGEST_MULTI *m;
+  int raw = lua_toboolean(L, 3);
+
+  lua_settop(L, 3);
+  m = digest_multi_create(L, 1);
+  /* owned by gc from here, feed may raise on bad input */
+  PUSH_OBJECT(m, "openssl.digest_multi");
+  if (!digest_multi_feed(L, m, 2))
+    return openssl_pushresult(L, 0);
+  return digest_multi_push(L, m, raw);
+}
+
+static LUA_FUNCTION(openssl_digest_multi_new)
+{
+  DIGEST_MULTI *m = digest_multi_create(L, 1);
+  PUSH_OBJECT(m, "openssl.digest_multi");
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_digest_multi_update)
+{
+  DIGEST_MULTI *m = CHECK_OBJECT(1, DIGEST_MULTI, "openssl.digest_multi");
+  return openssl_pushresult(L, digest_multi_feed(L, m, 2));
+}
+
+static LUA_FUNCTION(openssl_digest_multi_final)
+{
+  DIGEST_MULTI *m = CHECK_OBJECT(1, DIGEST_MULTI, "openssl.digest_multi");
+  return digest_multi_push(L, m, lua_toboolean(L, 2));
+}
+
+static LUA_FUNCTION(openssl_digest_multi_free)
+{
+  DIGEST_MULTI *m = CHECK_OBJECT(1, DIGEST_MULTI, "openssl.digest_multi");
+  lua_pushnil(L);
+  lua_setmetatable(L, 1);
+  digest_multi_free(m);
+  return 0;
+}
+
+/*
+ * Merkle tree hash in RFC 6962 style, leaf is H(0x00 || data) over fixed
+ * size leaves, node is H(0x01 || left || right) and last node of an odd
+ * level moves up unchanged. Leaves are hashed by a pool of threads, each
+ * taking a contiguous range, then inner nodes are hashed in calling thread.
+ */
+#define TREE_LEAF_SIZE  (1024 * 1024)
+
+typedef struct
+{
+  const EVP_MD *md;
+  const unsigned char *data;  /* whole input, or NULL to read from path */
+  const char *path;
+  uint64_t size;
+  size_t leaf;
+  size_t first, count;        /* leaf range of this job */
+  unsigned char *out;         /* digest of each leaf */
+  int ok;
+  int err;                    /* errno of failed file access, -1 when file shrank */
+} TREE_JOB;
+
+static int tree_hash(const EVP_MD *md, unsigned char prefix, const unsigned char *a, size_t alen,
+                     const unsigned char *b, size_t blen, unsigned char *out)
+{
+  EVP_MD_CTX *c = EVP_MD_CTX_create();
+  int ret = EVP_DigestInit_ex(c, md, NULL) == 1
+            && EVP_DigestUpdate(c, &prefix, 1) == 1
+            && EVP_DigestUpdate(c, a, alen) == 1
+            && (blen == 0 || EVP_DigestUpdate(c, b, blen) == 1)
+            && EVP_DigestFinal_ex(c, out, NULL) == 1;
+  EVP_MD_CTX_destroy(c);
+  return ret;
+}
+
+static int tree_seek(FILE *fp, uint64_t off)
+{
+#ifdef WIN32
+  return _fseeki64(fp, (__int64)off, SEEK_SET);
+#else
+  return fseeko(fp, (off_t)off, SEEK_SET);
+#endif
+}
+
+static void tree_job_run(void *arg)
+{
+  TREE_JOB *job = arg;
+  int mdlen = EVP_MD_size(job->md);
+  unsigned char *buf = NULL;
+  FILE *fp = NULL;
+  size_t i;
+
+  if (job->count == 0)
+  {
+    job->ok = 1;
+    return;
+  }
+  if (job->data == NULL)
+  {
+    /* errno is per thread, keep it in job for caller */
+    errno = 0;
+    fp = fopen(job->path, "rb");
+    buf = malloc(job->leaf);
+    if (fp == NULL || buf == NULL || tree_seek(fp, (uint64_t)job->first * job->leaf) != 0)
+    {
+      job->err = errno;
+      goto done;
+    }
+  }
+  for (i = 0; i < job->count; i++)
+  {
+    uint64_t off = (uint64_t)(job->first + i) * job->leaf;
+    size_t len = job->size - off < job->leaf ? (size_t)(job->size - off) : job->leaf;
+    const unsigned char *leaf = job->data ? job->data + off : buf;
+    if (fp && fread(buf, 1, len, fp) != len)
+    {
+      job->err = ferror(fp) ? errno : -1;
+      goto done;
+    }
+    if (!tree_hash(job->md, 0, leaf, len, NULL, 0, job->out + i * mdlen))
+      goto done;
+  }
+  job->ok = 1;
+done:
+  if (fp)
+    fclose(fp);
+  free(buf);
+}
+
+/* fold leaf digests in place up to root */
+static int tree_root(const EVP_MD *md, unsigned char *nodes, size_t n, unsigned char *root)
+{
+  int mdlen = EVP_MD_size(md);
+  if (n == 0)
+    return EVP_Digest("", 0, root, NULL, md, NULL) == 1;
+  while (n > 1)
+  {
+    size_t i, m = 0;
+    for (i = 0; i + 1 < n; i += 2, m++)
+    {
+      if (!tree_hash(md, 1, nodes + i * mdlen, mdlen, nodes + (i + 1) * mdlen, mdlen, nodes + m * mdlen))
+        return 0;
+    }
+    if (i < n)
+      memmove(nodes + m++ * mdlen, nodes + i * mdlen, mdlen);
+    n = m;
+  }
+  memcpy(root, nodes, mdlen);
+  return 1;
+}
+
+static int openssl_digest_tree_run(lua_State *L, const unsigned char *data, const char *path, uint64_t size)
+{
+  const EVP_MD *md = get_digest(L, 1);
+  lua_Integer leaf = TREE_LEAF_SIZE;
+  int threads = openssl_cpu_count();
+  int raw = 0, leaves = 0, mdlen, i, n, ok = 1, err = 0;
+  unsigned char root[EVP_MAX_MD_SIZE];
+  unsigned char *nodes;
+  size_t count, per;
+  TREE_JOB *jobs;
+
+  if (lua_istable(L, 3))
+  {
+    lua_getfield(L, 3, "leaf");
+    leaf = luaL_optinteger(L, -1, leaf);
+    lua_getfield(L, 3, "threads");
+    threads = luaL_optint(L, -1, threads);
+    lua_getfield(L, 3, "raw");
+    raw = lua_toboolean(L, -1);
+    lua_getfield(L, 3, "leaves");
+    leaves = lua_toboolean(L, -1);
+    lua_pop(L, 4);
+  }
+  luaL_argcheck(L, leaf >= 1024, 3, "leaf size must be at least 1024");
+  luaL_argcheck(L, threads > 0, 3, "threads must greater than 0");
+
+  mdlen = EVP_MD_size(md);
+  count = (size_t)((size + leaf - 1) / leaf);
+  n = count < (size_t)threads ? (int)count : threads;
+  n = n > 0 ? n : 1;
+  per = (count + n - 1) / n;
+
+  nodes = malloc(count ? count * mdlen : 1);
+  jobs = calloc(n, sizeof(TREE_JOB));
+  if (!nodes || !jobs)
+  {
+    free(nodes);
+    free(jobs);
+    return luaL_error(L, "alloc tree hash fail");
+  }
+  for (i = 0; i < n; i++)
+  {
+    TREE_JOB *job = &jobs[i];
+    job->md = md;
+    job->data = data;
+    job->path = path;
+    job->size = size;
+    job->leaf = (size_t)leaf;
+    job->first = per * i < count ? per * i : count;
+    job->count = count - job->first < per ? count - job->first : per;
+    job->out = nodes + job->first * mdlen;
+  }
+  openssl_parallel_run(tree_job_run, jobs, sizeof(TREE_JOB), n);
+  for (i = 0; i < n; i++)
+  {
+    if (ok && !jobs[i].ok)
+      err = jobs[i].err;
+    ok = ok && jobs[i].ok;
+  }
+  free(jobs);
+
+  if (ok && leaves)
+  {
+    size_t j;
+    lua_createtable(L, (int)count, 0);
+    for (j = 0; j < count; j++)
+    {
+      lua_pushlstring(L, (const char*)nodes + j * mdlen, mdlen);
+      lua_rawseti(L, -2, (int)j + 1);
+    }
+  }
+  ok = ok && tree_root(md, nodes, count, root);
+  free(nodes);
+  if (!ok)
+  {
+    if (leaves)
+      lua_pop(L, 1);
+    if (path && err)
+    {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", path, err > 0 ? strerror(err) : "file changed while hashing");
+      return 2;
+    }
+    return openssl_pushresult(L, 0);
+  }
+  digest_push(L, root, mdlen, raw);
+  if (leaves)
+  {
+    lua_insert(L, -2);
+    return 2;
+  }
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_digest_tree)
+{
+  size_t len;
+  const char *data = openssl_checklbuffer(L, 2, &len);
+  return openssl_digest_tree_run(L, (const unsigned char*)data, NULL, len);
+}
+
+static LUA_FUNCTION(openssl_digest_tree_file)
+{
+  const char *path = luaL_checkstring(L, 2);
+  FILE *fp;
+  uint64_t size;
+
+  errno = 0;
+  fp = fopen(path, "rb");
+#ifdef WIN32
+  if (fp == NULL || _fseeki64(fp, 0, SEEK_END) != 0 || (size = (uint64_t)_ftelli64(fp)) == (uint64_t)-1)
+#else
+  if (fp == NULL || fseeko(fp, 0, SEEK_END) != 0 || (size = (uint64_t)ftello(fp)) == (uint64_t)-1)
+#endif
+  {
+    if (fp)
+      fclose(fp);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+  fclose(fp);
+  return openssl_digest_tree_run(L, NULL, path, size);
+}
+
+/* root of tree from leaf digests, to verify part of data or resume */
+static LUA_FUNCTION(openssl_digest_tree_root)
+{
+  const EVP_MD *md = get_digest(L, 1);
+  int raw = lua_toboolean(L, 3);
+  int mdlen = EVP_MD_size(md);
+  unsigned char root[EVP_MAX_MD_SIZE];
+  unsigned char *nodes;
+  size_t i, count;
+  int ok;
+
+  luaL_checktable(L, 2);
+  count = lua_rawlen(L, 2);
+  nodes = malloc(count ? count * mdlen : 1);
+  if (nodes == NULL)
+    return luaL_error(L, "alloc tree hash fail");
+  for (i = 0; i < count; i++)
+  {
+    size_t len;
+    const char *leaf;
+    lua_rawgeti(L, 2, (int)i + 1);
+    leaf = lua_tolstring(L, -1, &len);
+    if (leaf == NULL || len != (size_t)mdlen)
+    {
+      free(nodes);
+      return luaL_argerror(L, 2, "leaf digest with wrong length");
+    }
+    memcpy(nodes + i * mdlen, leaf, mdlen);
+    lua_pop(L, 1);
+  }
+  ok = tree_root(md, nodes, count, root);
+  free(nodes);
+  if (!ok)
+    return openssl_pushresult(L, 0);
+  digest_push(L, root, mdlen, raw);
+  return 1;
+}
+
 static luaL_Reg digest_funs[] =
 {
   {"new",       openssl_evp_digest_init},
   {"info",      openssl_digest_info},
   {"digest",      openssl_digest_digest},
+  {"file",        openssl_digest_file},
   {"__tostring",    auxiliar_tostring},
 
   {NULL, NULL}
@@ -303,6 +810,15 @@ static luaL_Reg digest_ctx_funs[] =
   {NULL, NULL}
 };
 
+static luaL_Reg digest_multi_funs[] =
+{
+  {"update",      openssl_digest_multi_update},
+  {"final",       openssl_digest_multi_final},
+  {"__tostring",  auxiliar_tostring},
+  {"__gc",        openssl_digest_multi_free},
+  {NULL, NULL}
+};
+
 static const luaL_Reg R[] =
 {
   { "__call",  openssl_digest},
@@ -310,6 +826,12 @@ static const luaL_Reg R[] =
   { "get",   openssl_digest_get},
   { "new",   openssl_digest_new},
   { "digest",  openssl_digest},
+  { "file",    openssl_digest_file},
+  { "multi",   openssl_digest_multi},
+  { "multi_new", openssl_digest_multi_new},
+  { "tree",    openssl_digest_tree},
+  { "tree_file", openssl_digest_tree_file},
+  { "tree_root", openssl_digest_tree_root},
 
   {NULL,  NULL}
 };
@@ -318,6 +840,7 @@ int luaopen_digest(lua_State *L)
 {
   auxiliar_newclass(L, "openssl.evp_digest",   digest_funs);
   auxiliar_newclass(L, "openssl.evp_digest_ctx", digest_ctx_funs);
+  auxiliar_newclass(L, "openssl.digest_multi", digest_multi_funs);
 
   lua_newtable(L);
   luaL_setfuncs(L, R, 0);
@@ -0,0 +1,430 @@
+/*=========================================================================*\
+* kdf.c
+* key derivation module for lua-openssl binding
+*
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+
+#include "openssl.h"
+#include "private.h"
+#include <stdint.h>
+#include <openssl/hmac.h>
+
+#define MYNAME    "kdf"
+#define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
+  "based on OpenSSL " SHLIB_VERSION_NUMBER
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_SCRYPT)
+#define KDF_HAVE_SCRYPT
+#endif
+
+typedef enum
+{
+  KDF_PBKDF2 = 0,
+  KDF_HKDF,
+  KDF_HKDF_EXTRACT,
+  KDF_HKDF_EXPAND,
+  KDF_SCRYPT
+} KDF_TYPE;
+
+static const char* kdf_types[] =
+{
+  "pbkdf2",
+  "hkdf",
+  "hkdf_extract",
+  "hkdf_expand",
+  "scrypt",
+  NULL
+};
+
+/*
+ * Arguments of one derivation. Sync calls point into lua strings, async
+ * jobs own copies since they outlive the call.
+ */
+typedef struct
+{
+  KDF_TYPE type;
+  const EVP_MD *md;
+  const unsigned char *pass;  /* password, ikm or prk */
+  size_t pass_len;
+  const unsigned char *salt;
+  size_t salt_len;
+  const unsigned char *info;
+  size_t info_len;
+  int iter;
+  uint64_t N, r, p, maxmem;
+  unsigned char *out;
+  size_t out_len;
+  int ok;
+  unsigned long err;
+  OPENSSL_ASYNC *async;
+} KDF_JOB;
+
+static int kdf_hkdf_extract(const EVP_MD *md, const unsigned char *salt, size_t salt_len,
+                            const unsigned char *ikm, size_t ikm_len, unsigned char *prk, unsigned int *prk_len)
+{
+  unsigned char zeros[EVP_MAX_MD_SIZE] = {0};
+  /* RFC 5869, missing salt is HashLen zeros */
+  if (salt == NULL || salt_len == 0)
+  {
+    salt = zeros;
+    salt_len = EVP_MD_size(md);
+  }
+  return HMAC(md, salt, (int)salt_len, ikm, ikm_len, prk, prk_len) != NULL;
+}
+
+static int kdf_hkdf_expand(const EVP_MD *md, const unsigned char *prk, size_t prk_len,
+                           const unsigned char *info, size_t info_len, unsigned char *out, size_t out_len)
+{
+  size_t mdlen = EVP_MD_size(md), done = 0;
+  unsigned char t[EVP_MAX_MD_SIZE];
+  unsigned int tlen = 0;
+  unsigned char i;
+  HMAC_CTX *c;
+  int ret = 1;
+
+  if (out_len > 255 * mdlen)
+    return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  c = HMAC_CTX_new();
+#else
+  c = OPENSSL_malloc(sizeof(HMAC_CTX));
+  HMAC_CTX_init(c);
+#endif
+  for (i = 1; ret && done < out_len; i++)
+  {
+    ret = HMAC_Init_ex(c, prk, (int)prk_len, md, NULL) == 1
+          && HMAC_Update(c, t, tlen) == 1
+          && (info_len == 0 || HMAC_Update(c, info, info_len) == 1)
+          && HMAC_Update(c, &i, 1) == 1
+          && HMAC_Final(c, t, &tlen) == 1;
+    if (ret)
+    {
+      size_t n = out_len - done < tlen ? out_len - done : tlen;
+      memcpy(out + done, t, n);
+      done += n;
+    }
+  }
+  OPENSSL_cleanse(t, sizeof(t));
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  HMAC_CTX_free(c);
+#else
+  HMAC_CTX_cleanup(c);
+  OPENSSL_free(c);
+#endif
+  return ret;
+}
+
+static void kdf_job_run(void *arg)
+{
+  KDF_JOB *job = arg;
+  unsigned char prk[EVP_MAX_MD_SIZE];
+  unsigned int prk_len = 0;
+
+  switch (job->type)
+  {
+  case KDF_PBKDF2:
+    job->ok = PKCS5_PBKDF2_HMAC((const char*)job->pass, (int)job->pass_len, job->salt, (int)job->salt_len,
+                                job->iter, job->md, (int)job->out_len, job->out) == 1;
+    break;
+  case KDF_HKDF:
+    job->ok = kdf_hkdf_extract(job->md, job->salt, job->salt_len, job->pass, job->pass_len, prk, &prk_len)
+              && kdf_hkdf_expand(job->md, prk, prk_len, job->info, job->info_len, job->out, job->out_len);
+    OPENSSL_cleanse(prk, sizeof(prk));
+    break;
+  case KDF_HKDF_EXTRACT:
+    job->ok = kdf_hkdf_extract(job->md, job->salt, job->salt_len, job->pass, job->pass_len, job->out, &prk_len);
+    job->out_len = prk_len;
+    break;
+  case KDF_HKDF_EXPAND:
+    job->ok = kdf_hkdf_expand(job->md, job->pass, job->pass_len, job->info, job->info_len, job->out, job->out_len);
+    break;
+#ifdef KDF_HAVE_SCRYPT
+  case KDF_SCRYPT:
+    job->ok = EVP_PBE_scrypt((const char*)job->pass, job->pass_len, job->salt, job->salt_len,
+                             job->N, job->r, job->p, job->maxmem, job->out, job->out_len) == 1;
+    break;
+#endif
+  default:
+    job->ok = 0;
+  }
+  /* error queue is per thread, keep it for caller */
+  if (!job->ok)
+    job->err = ERR_get_error();
+}
+
+static const EVP_MD* kdf_optdigest(lua_State *L, int idx)
+{
+  const EVP_MD *md;
+  if (lua_isnoneornil(L, idx))
+    return EVP_sha256();
+  md = get_digest(L, idx);
+  luaL_argcheck(L, md != NULL, idx, "not valid digest alg");
+  return md;
+}
+
+/*
+ * parse arguments of type from idx:
+ *  pbkdf2        password, salt, iter, keylen[, md='sha256']
+ *  hkdf          md, ikm, salt, info, keylen
+ *  hkdf_extract  md, ikm[, salt]
+ *  hkdf_expand   md, prk, info, keylen
+ *  scrypt        password, salt, N, r, p, keylen[, maxmem]
+ */
+static void kdf_parse(lua_State *L, KDF_TYPE type, int idx, KDF_JOB *job)
+{
+  lua_Integer keylen = 0;
+  int karg = idx;
+  memset(job, 0, sizeof(KDF_JOB));
+  job->type = type;
+
+  switch (type)
+  {
+  case KDF_PBKDF2:
+    job->pass = (const unsigned char*)luaL_checklstring(L, idx, &job->pass_len);
+    job->salt = (const unsigned char*)luaL_checklstring(L, idx + 1, &job->salt_len);
+    job->iter = luaL_checkint(L, idx + 2);
+    karg = idx + 3;
+    keylen = luaL_checkinteger(L, karg);
+    job->md = kdf_optdigest(L, idx + 4);
+    luaL_argcheck(L, job->iter > 0, idx + 2, "must greater than 0");
+    break;
+  case KDF_HKDF:
+  case KDF_HKDF_EXTRACT:
+  case KDF_HKDF_EXPAND:
+    luaL_checkany(L, idx);
+    job->md = kdf_optdigest(L, idx);
+    job->pass = (const unsigned char*)luaL_checklstring(L, idx + 1, &job->pass_len);
+    if (type == KDF_HKDF)
+    {
+      job->salt = (const unsigned char*)luaL_optlstring(L, idx + 2, NULL, &job->salt_len);
+      job->info = (const unsigned char*)luaL_optlstring(L, idx + 3, "", &job->info_len);
+      karg = idx + 4;
+      keylen = luaL_checkinteger(L, karg);
+    }
+    else if (type == KDF_HKDF_EXTRACT)
+    {
+      job->salt = (const unsigned char*)luaL_optlstring(L, idx + 2, NULL, &job->salt_len);
+      keylen = EVP_MD_size(job->md);
+    }
+    else
+    {
+      job->info = (const unsigned char*)luaL_optlstring(L, idx + 2, "", &job->info_len);
+      karg = idx + 3;
+      keylen = luaL_checkinteger(L, karg);
+    }
+    luaL_argcheck(L, keylen <= 255 * EVP_MD_size(job->md), karg, "keylen too long for HKDF");
+    break;
+  case KDF_SCRYPT:
+#ifdef KDF_HAVE_SCRYPT
+    job->pass = (const unsigned char*)luaL_checklstring(L, idx, &job->pass_len);
+    job->salt = (const unsigned char*)luaL_checklstring(L, idx + 1, &job->salt_len);
+    {
+      lua_Integer N = luaL_checkinteger(L, idx + 2);
+      lua_Integer r = luaL_checkinteger(L, idx + 3);
+      lua_Integer p = luaL_checkinteger(L, idx + 4);
+      lua_Integer maxmem = luaL_optinteger(L, idx + 6, 0);
+      luaL_argcheck(L, N > 1 && (N & (N - 1)) == 0, idx + 2, "N must be power of 2");
+      luaL_argcheck(L, r > 0, idx + 3, "must greater than 0");
+      luaL_argcheck(L, p > 0, idx + 4, "must greater than 0");
+      luaL_argcheck(L, maxmem >= 0, idx + 6, "must not be negative");
+      job->N = (uint64_t)N;
+      job->r = (uint64_t)r;
+      job->p = (uint64_t)p;
+      job->maxmem = (uint64_t)maxmem;
+    }
+    karg = idx + 5;
+    keylen = luaL_checkinteger(L, karg);
+#else
+    luaL_error(L, "scrypt not supported by this openssl");
+#endif
+    break;
+  }
+  luaL_argcheck(L, keylen > 0 && keylen <= 0x7fffffff, karg, "invalid keylen");
+  job->out_len = (size_t)keylen;
+}
+
+static int kdf_push(lua_State *L, KDF_JOB *job)
+{
+  if (job->ok)
+  {
+    lua_pushlstring(L, (const char*)job->out, job->out_len);
+    return 1;
+  }
+  lua_pushnil(L);
+  if (job->err)
+  {
+    char err[LUAL_BUFFERSIZE] = {0};
+    ERR_error_string_n(job->err, err, sizeof(err));
+    lua_pushstring(L, err);
+    lua_pushinteger(L, job->err);
+    return 3;
+  }
+  lua_pushstring(L, "key derivation fail");
+  return 2;
+}
+
+static int kdf_run(lua_State *L, KDF_TYPE type)
+{
+  KDF_JOB job;
+  int ret;
+  kdf_parse(L, type, 1, &job);
+  job.out = malloc(job.out_len);
+  if (job.out == NULL)
+    return luaL_error(L, "alloc key fail");
+  kdf_job_run(&job);
+  ret = kdf_push(L, &job);
+  OPENSSL_cleanse(job.out, job.out_len);
+  free(job.out);
+  return ret;
+}
+
+static LUA_FUNCTION(openssl_kdf_pbkdf2)
+{
+  return kdf_run(L, KDF_PBKDF2);
+}
+
+static LUA_FUNCTION(openssl_kdf_hkdf)
+{
+  return kdf_run(L, KDF_HKDF);
+}
+
+static LUA_FUNCTION(openssl_kdf_hkdf_extract)
+{
+  return kdf_run(L, KDF_HKDF_EXTRACT);
+}
+
+static LUA_FUNCTION(openssl_kdf_hkdf_expand)
+{
+  return kdf_run(L, KDF_HKDF_EXPAND);
+}
+
+#ifdef KDF_HAVE_SCRYPT
+static LUA_FUNCTION(openssl_kdf_scrypt)
+{
+  return kdf_run(L, KDF_SCRYPT);
+}
+#endif
+
+static void* kdf_dup(const void *p, size_t len)
+{
+  void *d = malloc(len ? len : 1);
+  if (d && len)
+    memcpy(d, p, len);
+  return d;
+}
+
+static void kdf_job_release(void *arg)
+{
+  KDF_JOB *job = arg;
+  if (job->pass)
+    OPENSSL_cleanse((void*)job->pass, job->pass_len);
+  if (job->out)
+    OPENSSL_cleanse(job->out, job->out_len);
+  free((void*)job->pass);
+  free((void*)job->salt);
+  free((void*)job->info);
+  free(job->out);
+  free(job);
+}
+
+/* a running job is freed by its own thread, so gc never blocks on it */
+static void kdf_job_free(KDF_JOB *job)
+{
+  if (job->async)
+    openssl_async_detach(job->async, kdf_job_release);
+  else
+    kdf_job_release(job);
+}
+
+/* kdf.async(type, ...) run derivation on a background thread */
+static LUA_FUNCTION(openssl_kdf_async)
+{
+  KDF_TYPE type = (KDF_TYPE)luaL_checkoption(L, 1, NULL, kdf_types);
+  KDF_JOB parsed, *job = calloc(1, sizeof(KDF_JOB));
+
+  if (job == NULL)
+    return luaL_error(L, "alloc kdf job fail");
+  /* PUSH_OBJECT first, so job is freed by gc if parse raises error */
+  PUSH_OBJECT(job, "openssl.kdf_job");
+  kdf_parse(L, type, 2, &parsed);
+
+  *job = parsed;
+  job->pass = kdf_dup(parsed.pass, parsed.pass_len);
+  job->salt = parsed.salt ? kdf_dup(parsed.salt, parsed.salt_len) : NULL;
+  job->info = parsed.info ? kdf_dup(parsed.info, parsed.info_len) : NULL;
+  job->out = malloc(job->out_len);
+  if (!job->pass || (parsed.salt && !job->salt) || (parsed.info && !job->info) || !job->out)
+    return luaL_error(L, "alloc kdf job fail");
+
+  job->async = openssl_async_start(kdf_job_run, job);
+  if (job->async == NULL)
+    kdf_job_run(job);
+  return 1;
+}
+
+static LUA_FUNCTION(openssl_kdf_job_done)
+{
+  KDF_JOB *job = CHECK_OBJECT(1, KDF_JOB, "openssl.kdf_job");
+  lua_pushboolean(L, job->async == NULL || openssl_async_done(job->async));
+  return 1;
+}
+
+/* wait job finish and return derived key */
+static LUA_FUNCTION(openssl_kdf_job_result)
+{
+  KDF_JOB *job = CHECK_OBJECT(1, KDF_JOB, "openssl.kdf_job");
+  if (job->async)
+  {
+    openssl_async_wait(job->async);
+    job->async = NULL;
+  }
+  return kdf_push(L, job);
+}
+
+static LUA_FUNCTION(openssl_kdf_job_free)
+{
+  KDF_JOB *job = CHECK_OBJECT(1, KDF_JOB, "openssl.kdf_job");
+  lua_pushnil(L);
+  lua_setmetatable(L, 1);
+  kdf_job_free(job);
+  return 0;
+}
+
+static luaL_Reg kdf_job_funs[] =
+{
+  {"done",        openssl_kdf_job_done},
+  {"result",      openssl_kdf_job_result},
+
+  {"__gc",        openssl_kdf_job_free},
+  {"__tostring",  auxiliar_tostring},
+
+  {NULL, NULL}
+};
+
+static const luaL_Reg R[] =
+{
+  {"pbkdf2",        openssl_kdf_pbkdf2},
+  {"hkdf",          openssl_kdf_hkdf},
+  {"hkdf_extract",  openssl_kdf_hkdf_extract},
+  {"hkdf_expand",   openssl_kdf_hkdf_expand},
+#ifdef KDF_HAVE_SCRYPT
+  {"scrypt",        openssl_kdf_scrypt},
+#endif
+  {"async",         openssl_kdf_async},
+
+  {NULL,  NULL}
+};
+
+int luaopen_kdf(lua_State *L)
+{
+  auxiliar_newclass(L, "openssl.kdf_job", kdf_job_funs);
+
+  lua_newtable(L);
+  luaL_setfuncs(L, R, 0);
+  lua_pushliteral(L, "version");    /** version */
+  lua_pushliteral(L, MYVERSION);
+  lua_settable(L, -3);
+
+  return 1;
+}
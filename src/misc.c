@@ -151,16 +151,299 @@ int openssl_pushresult(lua_State*L, int result)
   return 0;
 }
 
+/*
+ * hex and base64 codecs. Where the compiler targets SSE2, to_hex converts
+ * 16 bytes per step, from_hex 32 chars, base64 encode 12 bytes and decode
+ * 16 chars. Characters are classified with range compares, so no shuffle
+ * instruction beyond SSE2 is needed. Blocks holding whitespace, padding or
+ * invalid input, the tail and other targets use the tables.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OPENSSL_CODEC_SSE2
+
+/* mask of bytes in [lo, hi], bytes above 0x7f compare negative */
+#define SSE2_RANGE(v, lo, hi) \
+  _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+#endif
+
 static const char* hex_tab = "0123456789abcdef";
 
+static const unsigned char hex_val[256] =
+{
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static const unsigned char b64_val[256] =
+{
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x40, 0x40, 0xff, 0xff, 0x40, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x40, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0x41, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+static const char* b64_std = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char* b64_url = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
 void to_hex(const char* in, int length, char* out)
 {
-  int i;
-  for (i = 0; i < length; i++) {
-    out[i*2] = hex_tab[(in[i] >> 4) & 0xF];
-    out[i*2+1] = hex_tab[(in[i]) & 0xF];
+  const unsigned char* s = (const unsigned char*)in;
+  int i = 0;
+#ifdef OPENSSL_CODEC_SSE2
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i digit = _mm_set1_epi8('0');
+  const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+    /* nibble + '0', plus 'a'-'0'-10 for nibbles above 9 */
+    a = _mm_add_epi8(_mm_add_epi8(a, digit), _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+    b = _mm_add_epi8(_mm_add_epi8(b, digit), _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+    _mm_storeu_si128((__m128i*)(out + i * 2), a);
+    _mm_storeu_si128((__m128i*)(out + i * 2 + 16), b);
   }
-  out[i*2] = '\0';
+#endif
+  for (; i < length; i++)
+  {
+    out[i * 2] = hex_tab[s[i] >> 4];
+    out[i * 2 + 1] = hex_tab[s[i] & 0xF];
+  }
+  out[i * 2] = '\0';
+}
+
+/* decode hex string, upper or lower case, return bytes or -1 if invalid */
+int from_hex(const char* in, size_t length, char* out)
+{
+  const unsigned char* s = (const unsigned char*)in;
+  size_t i = 0;
+  if (length % 2)
+    return -1;
+#ifdef OPENSSL_CODEC_SSE2
+  for (; i + 32 <= length; i += 32)
+  {
+    __m128i v[2];
+    int j;
+    for (j = 0; j < 2; j++)
+    {
+      __m128i c = _mm_loadu_si128((const __m128i*)(s + i + j * 16));
+      __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+      __m128i digit = SSE2_RANGE(c, '0', '9');
+      __m128i alpha = SSE2_RANGE(l, 'a', 'f');
+      if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+        return -1;
+      c = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                       _mm_and_si128(alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+      /* high nibble is the even char, low 8 bits of each 16 bit lane */
+      v[j] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, _mm_set1_epi16(0x0f)), 4),
+                          _mm_srli_epi16(c, 8));
+    }
+    _mm_storeu_si128((__m128i*)(out + i / 2), _mm_packus_epi16(v[0], v[1]));
+  }
+#endif
+  for (; i < length; i += 2)
+  {
+    unsigned char h = hex_val[s[i]], l = hex_val[s[i + 1]];
+    if ((h | l) & 0xf0)
+      return -1;
+    out[i / 2] = (char)(h << 4 | l);
+  }
+  return (int)(length / 2);
+}
+
+/*
+ * base64 encode, out must hold 4 * ((length + 2) / 3) + 1 bytes. url selects
+ * base64url alphabet without padding. return length of out.
+ */
+size_t openssl_base64_encode(const char* in, size_t length, char* out, int url)
+{
+  const unsigned char* s = (const unsigned char*)in;
+  const char* tab = url ? b64_url : b64_std;
+  size_t i = 0, o = 0;
+#ifdef OPENSSL_CODEC_SSE2
+  const __m128i c62 = _mm_set1_epi8(url ? '-' - 62 : '+' - 62);
+  const __m128i c63 = _mm_set1_epi8(url ? '_' - 63 : '/' - 63);
+  /* loads 16 bytes, uses 12 */
+  for (; i + 16 <= length; i += 12, o += 16)
+  {
+    /* spread 3 byte groups to 32 bit lanes, u = b0 | b1 << 8 | b2 << 16 */
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i)), d;
+    __m128i u = _mm_or_si128(
+                  _mm_or_si128(_mm_and_si128(v, _mm_setr_epi32(0xffffff, 0, 0, 0)),
+                               _mm_and_si128(_mm_slli_si128(v, 1), _mm_setr_epi32(0, 0xffffff, 0, 0))),
+                  _mm_or_si128(_mm_and_si128(_mm_slli_si128(v, 2), _mm_setr_epi32(0, 0, 0xffffff, 0)),
+                               _mm_and_si128(_mm_slli_si128(v, 3), _mm_setr_epi32(0, 0, 0, 0xffffff))));
+    /* 6 bit indices in output byte order */
+    __m128i x = _mm_or_si128(
+                  _mm_or_si128(_mm_and_si128(_mm_srli_epi32(u, 2), _mm_set1_epi32(0x3f)),
+                               _mm_and_si128(_mm_slli_epi32(u, 12), _mm_set1_epi32(0x3000))),
+                  _mm_or_si128(_mm_and_si128(_mm_srli_epi32(u, 4), _mm_set1_epi32(0x0f00)),
+                               _mm_and_si128(_mm_slli_epi32(u, 10), _mm_set1_epi32(0x3c0000))));
+    x = _mm_or_si128(x, _mm_or_si128(_mm_and_si128(_mm_srli_epi32(u, 6), _mm_set1_epi32(0x030000)),
+                                     _mm_and_si128(_mm_slli_epi32(u, 8), _mm_set1_epi32(0x3f000000))));
+    d = _mm_set1_epi8('A');
+    d = _mm_add_epi8(d, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(25)), _mm_set1_epi8('a' - 26 - 'A')));
+    d = _mm_add_epi8(d, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(51)), _mm_set1_epi8('0' - 52 - ('a' - 26))));
+    d = _mm_add_epi8(d, _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(62)), _mm_sub_epi8(c62, _mm_set1_epi8('0' - 52))));
+    d = _mm_add_epi8(d, _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(63)), _mm_sub_epi8(c63, _mm_set1_epi8('0' - 52))));
+    _mm_storeu_si128((__m128i*)(out + o), _mm_add_epi8(x, d));
+  }
+#endif
+  for (; i + 3 <= length; i += 3)
+  {
+    unsigned long v = (unsigned long)s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+    out[o++] = tab[v >> 18];
+    out[o++] = tab[(v >> 12) & 0x3f];
+    out[o++] = tab[(v >> 6) & 0x3f];
+    out[o++] = tab[v & 0x3f];
+  }
+  if (i < length)
+  {
+    unsigned long v = (unsigned long)s[i] << 16 | (i + 1 < length ? s[i + 1] << 8 : 0);
+    out[o++] = tab[v >> 18];
+    out[o++] = tab[(v >> 12) & 0x3f];
+    if (i + 1 < length)
+      out[o++] = tab[(v >> 6) & 0x3f];
+    else if (!url)
+      out[o++] = '=';
+    if (!url)
+      out[o++] = '=';
+  }
+  out[o] = '\0';
+  return o;
+}
+
+/*
+ * base64 decode, both alphabets are accepted, padding is optional and
+ * whitespace is skipped. out must hold length / 4 * 3 + 3 bytes.
+ * return 1 and set *outlen on success, 0 for invalid input.
+ */
+int openssl_base64_decode(const char* in, size_t length, char* out, size_t* outlen)
+{
+  const unsigned char* s = (const unsigned char*)in;
+  size_t i = 0, o = 0;
+  unsigned long acc = 0;
+  int n = 0, pad = 0;
+
+  while (i < length)
+  {
+#ifdef OPENSSL_CODEC_SSE2
+    /* 16 chars of either alphabet, anything else goes to the loops below */
+    while (n == 0 && pad == 0 && i + 16 <= length)
+    {
+      __m128i c = _mm_loadu_si128((const __m128i*)(s + i));
+      __m128i upper = SSE2_RANGE(c, 'A', 'Z');
+      __m128i lower = SSE2_RANGE(c, 'a', 'z');
+      __m128i digit = SSE2_RANGE(c, '0', '9');
+      __m128i plus = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('+')), _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+      __m128i slash = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('/')), _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+      __m128i v;
+      if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower),
+                                         _mm_or_si128(digit, _mm_or_si128(plus, slash)))) != 0xffff)
+        break;
+      /* class masks are disjoint, pick each value as c minus class base */
+      v = _mm_or_si128(_mm_and_si128(upper, _mm_sub_epi8(c, _mm_set1_epi8('A'))),
+                       _mm_and_si128(lower, _mm_sub_epi8(c, _mm_set1_epi8('a' - 26))));
+      v = _mm_or_si128(v, _mm_and_si128(digit, _mm_add_epi8(c, _mm_set1_epi8(52 - '0'))));
+      v = _mm_or_si128(v, _mm_and_si128(plus, _mm_set1_epi8(62)));
+      v = _mm_or_si128(v, _mm_and_si128(slash, _mm_set1_epi8(63)));
+      /* merge 6 bit pairs into 12 bits, then 12 bit pairs into 24 */
+      v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 6), _mm_srli_epi16(v, 8));
+      v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+      /* big endian 3 bytes per lane, then 6 bytes per 64 bit half */
+      v = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xff)),
+                                    _mm_and_si128(v, _mm_set1_epi32(0xff00))),
+                       _mm_and_si128(_mm_slli_epi32(v, 16), _mm_set1_epi32(0xff0000)));
+      v = _mm_or_si128(_mm_and_si128(v, _mm_setr_epi32(0xffffff, 0, 0xffffff, 0)),
+                       _mm_and_si128(_mm_srli_epi64(v, 8), _mm_setr_epi32((int)0xff000000, 0xffff, (int)0xff000000, 0xffff)));
+      /* 14 bytes stored, the 2 past this block fit in the 3 byte slack of out */
+      _mm_storel_epi64((__m128i*)(out + o), v);
+      _mm_storel_epi64((__m128i*)(out + o + 6), _mm_srli_si128(v, 8));
+      o += 12;
+      i += 16;
+    }
+#endif
+    /* whole quartets, values 64 and above have bit 6 set */
+    while (n == 0 && pad == 0 && i + 4 <= length)
+    {
+      unsigned char a = b64_val[s[i]], b = b64_val[s[i + 1]], c = b64_val[s[i + 2]], d = b64_val[s[i + 3]];
+      unsigned long v;
+      if ((a | b | c | d) & 0xc0)
+        break;
+      v = (unsigned long)a << 18 | b << 12 | c << 6 | d;
+      out[o++] = (char)(v >> 16);
+      out[o++] = (char)(v >> 8);
+      out[o++] = (char)v;
+      i += 4;
+    }
+    if (i >= length)
+      break;
+
+    switch (b64_val[s[i++]])
+    {
+    case 64:
+      break;
+    case 65:
+      pad++;
+      break;
+    case 0xff:
+      return 0;
+    default:
+      if (pad)
+        return 0;
+      acc = acc << 6 | b64_val[s[i - 1]];
+      if (++n == 4)
+      {
+        out[o++] = (char)(acc >> 16);
+        out[o++] = (char)(acc >> 8);
+        out[o++] = (char)acc;
+        acc = 0;
+        n = 0;
+      }
+    }
+  }
+
+  if (n == 1 || (pad && (n == 0 || pad != 4 - n)))
+    return 0;
+  if (n == 2)
+    out[o++] = (char)(acc >> 4);
+  else if (n == 3)
+  {
+    out[o++] = (char)(acc >> 10);
+    out[o++] = (char)(acc >> 2);
+  }
+  *outlen = o;
+  return 1;
 }
 
 int openssl_push_bit_string_bitname(lua_State* L,const BIT_STRING_BITNAME* name) {
@@ -173,3 +456,347 @@ int openssl_push_bit_string_bitname(lua_State* L,const BIT_STRING_BITNAME* name)
   lua_setfield(L, -2, "sname");
   return 1;
 }
+
+/*
+ * Run fn over n jobs of size bytes each, one thread per job. Jobs must not
+ * touch lua_State. Without thread support jobs run one after another.
+ * openssl_async_start runs one job on a background thread, it returns NULL
+ * when no thread could start and caller should run the job itself.
+ * openssl_async_detach gives up waiting, free_fn(arg) then runs at once
+ * when job is done, or on its thread after job finishes.
+ *
+ * Threads are only used with OpenSSL 1.1.0 and later, which locks itself
+ * and frees per thread error state when a thread exits. Older versions
+ * rely on locking callbacks owned by the application, so jobs run serially.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && defined(WIN32)
+#include <windows.h>
+
+static DWORD WINAPI openssl_parallel_thread(LPVOID arg)
+{
+  void **t = arg;
+  ((void (*)(void*))t[0])(t[1]);
+  return 0;
+}
+
+int openssl_cpu_count(void)
+{
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
+void openssl_parallel_run(void (*fn)(void*), void* jobs, size_t size, int n)
+{
+  HANDLE *th = calloc(n, sizeof(HANDLE));
+  void **args = malloc(n * 2 * sizeof(void*));
+  int i;
+  for (i = 1; th && args && i < n; i++)
+  {
+    args[2 * i] = (void*)fn;
+    args[2 * i + 1] = (char*)jobs + i * size;
+    th[i] = CreateThread(NULL, 0, openssl_parallel_thread, args + 2 * i, 0, NULL);
+  }
+  /* first job and jobs failed to start run in calling thread */
+  for (i = 0; i < n; i++)
+  {
+    if (!th || th[i] == NULL)
+      fn((char*)jobs + i * size);
+  }
+  for (i = 1; th && i < n; i++)
+  {
+    if (th[i])
+    {
+      WaitForSingleObject(th[i], INFINITE);
+      CloseHandle(th[i]);
+    }
+  }
+  free(args);
+  free(th);
+}
+
+struct openssl_async_st
+{
+  HANDLE thread;
+  volatile LONG state;        /* 0 running, 1 done, 2 detached */
+  void (*fn)(void*);
+  void *arg;
+  void (*free_fn)(void*);
+};
+
+static DWORD WINAPI openssl_async_thread(LPVOID arg)
+{
+  OPENSSL_ASYNC *a = arg;
+  a->fn(a->arg);
+  if (InterlockedExchange(&a->state, 1) == 2)
+  {
+    a->free_fn(a->arg);
+    free(a);
+  }
+  return 0;
+}
+
+OPENSSL_ASYNC* openssl_async_start(void (*fn)(void*), void* arg)
+{
+  OPENSSL_ASYNC *a = calloc(1, sizeof(OPENSSL_ASYNC));
+  if (a == NULL)
+    return NULL;
+  a->fn = fn;
+  a->arg = arg;
+  a->thread = CreateThread(NULL, 0, openssl_async_thread, a, 0, NULL);
+  if (a->thread == NULL)
+  {
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+int openssl_async_done(OPENSSL_ASYNC* a)
+{
+  return WaitForSingleObject(a->thread, 0) == WAIT_OBJECT_0;
+}
+
+void openssl_async_wait(OPENSSL_ASYNC* a)
+{
+  WaitForSingleObject(a->thread, INFINITE);
+  CloseHandle(a->thread);
+  free(a);
+}
+
+void openssl_async_detach(OPENSSL_ASYNC* a, void (*free_fn)(void*))
+{
+  CloseHandle(a->thread);
+  a->free_fn = free_fn;
+  if (InterlockedExchange(&a->state, 2) == 1)
+  {
+    free_fn(a->arg);
+    free(a);
+  }
+}
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L && defined(PTHREADS)
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct
+{
+  void (*fn)(void*);
+  void *job;
+} PARALLEL_ARG;
+
+static void* openssl_parallel_thread(void *arg)
+{
+  PARALLEL_ARG *a = arg;
+  a->fn(a->job);
+  return NULL;
+}
+
+int openssl_cpu_count(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+void openssl_parallel_run(void (*fn)(void*), void* jobs, size_t size, int n)
+{
+  pthread_t *th = malloc(n * sizeof(pthread_t));
+  PARALLEL_ARG *args = malloc(n * sizeof(PARALLEL_ARG));
+  char *started = calloc(n, 1);
+  int i;
+
+  for (i = 1; th && args && started && i < n; i++)
+  {
+    args[i].fn = fn;
+    args[i].job = (char*)jobs + i * size;
+    started[i] = pthread_create(&th[i], NULL, openssl_parallel_thread, &args[i]) == 0;
+  }
+  /* first job and jobs failed to start run in calling thread */
+  for (i = 0; i < n; i++)
+  {
+    if (!started || !started[i])
+      fn((char*)jobs + i * size);
+  }
+  for (i = 1; started && i < n; i++)
+  {
+    if (started[i])
+      pthread_join(th[i], NULL);
+  }
+  free(started);
+  free(args);
+  free(th);
+}
+
+struct openssl_async_st
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int done;
+  int detached;
+  void (*fn)(void*);
+  void *arg;
+  void (*free_fn)(void*);
+};
+
+static void openssl_async_free(OPENSSL_ASYNC *a)
+{
+  a->free_fn(a->arg);
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+}
+
+static void* openssl_async_thread(void *arg)
+{
+  OPENSSL_ASYNC *a = arg;
+  int detached;
+  a->fn(a->arg);
+  pthread_mutex_lock(&a->lock);
+  a->done = 1;
+  detached = a->detached;
+  pthread_mutex_unlock(&a->lock);
+  /* nobody waits for a detached job, clean up after it */
+  if (detached)
+    openssl_async_free(a);
+  return NULL;
+}
+
+OPENSSL_ASYNC* openssl_async_start(void (*fn)(void*), void* arg)
+{
+  OPENSSL_ASYNC *a = calloc(1, sizeof(OPENSSL_ASYNC));
+  if (a == NULL)
+    return NULL;
+  a->fn = fn;
+  a->arg = arg;
+  pthread_mutex_init(&a->lock, NULL);
+  if (pthread_create(&a->thread, NULL, openssl_async_thread, a) != 0)
+  {
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+int openssl_async_done(OPENSSL_ASYNC* a)
+{
+  int done;
+  pthread_mutex_lock(&a->lock);
+  done = a->done;
+  pthread_mutex_unlock(&a->lock);
+  return done;
+}
+
+void openssl_async_wait(OPENSSL_ASYNC* a)
+{
+  pthread_join(a->thread, NULL);
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+}
+
+void openssl_async_detach(OPENSSL_ASYNC* a, void (*free_fn)(void*))
+{
+  int done;
+  pthread_detach(a->thread);
+  pthread_mutex_lock(&a->lock);
+  a->free_fn = free_fn;
+  a->detached = 1;
+  done = a->done;
+  pthread_mutex_unlock(&a->lock);
+  if (done)
+    openssl_async_free(a);
+}
+#else
+int openssl_cpu_count(void)
+{
+  return 1;
+}
+
+void openssl_parallel_run(void (*fn)(void*), void* jobs, size_t size, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    fn((char*)jobs + i * size);
+}
+
+/* no thread support, caller runs job itself */
+OPENSSL_ASYNC* openssl_async_start(void (*fn)(void*), void* arg)
+{
+  return NULL;
+}
+
+int openssl_async_done(OPENSSL_ASYNC* a)
+{
+  return 1;
+}
+
+void openssl_async_wait(OPENSSL_ASYNC* a)
+{
+}
+
+void openssl_async_detach(OPENSSL_ASYNC* a, void (*free_fn)(void*))
+{
+}
+#endif
+
+/*
+ * Feed file to cb in chunks of about chunk bytes, read into one buffer with
+ * kernel read ahead hinted sequential. Files are not mapped, a mapping of a
+ * file truncated by another process raises SIGBUS, a read just ends early.
+ * Return 1 on success, 0 when file fails or cb returns 0.
+ */
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+int openssl_file_foreach(const char* path, size_t chunk, openssl_chunk_cb cb, void* arg)
+{
+  unsigned char *buf;
+  int fd = open(path, O_RDONLY);
+  int ret = 1;
+  ssize_t n;
+
+  if (fd < 0)
+    return 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  buf = malloc(chunk);
+  if (buf == NULL)
+  {
+    close(fd);
+    return 0;
+  }
+  while (ret && (n = read(fd, buf, chunk)) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      ret = 0;
+    }
+    else
+      ret = cb(arg, buf, (size_t)n);
+  }
+  free(buf);
+  close(fd);
+  return ret;
+}
+#else
+int openssl_file_foreach(const char* path, size_t chunk, openssl_chunk_cb cb, void* arg)
+{
+  FILE* fp = fopen(path, "rb");
+  unsigned char *buf = malloc(chunk);
+  int ret = fp && buf;
+  size_t n;
+
+  while (ret && (n = fread(buf, 1, chunk, fp)) > 0)
+    ret = cb(arg, buf, n);
+  if (ret && fp && ferror(fp))
+    ret = 0;
+  if (fp)
+    fclose(fp);
+  free(buf);
+  return ret;
+}
+#endif
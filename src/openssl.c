@@ -23,31 +23,63 @@ static int openssl_version(lua_State*L)
 static LUA_FUNCTION(openssl_hex)
 {
   size_t l = 0;
-  const char* s = luaL_checklstring(L, 1, &l);
+  const char* s = openssl_checklbuffer(L, 1, &l);
   int hl = 0;
   int encode = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
   char* h = NULL;
-  BIGNUM *B = NULL;
 
   if (encode)
   {
     h = OPENSSL_malloc(l*2 + 1);
     to_hex(s,l,h);
-    hl = strlen(h);
+    hl = l * 2;
   }
   else
   {
-    BN_hex2bn(&B, s);
-    hl = l / 2;
-    h = OPENSSL_malloc( hl + 1 );
-    BN_bn2bin(B, (unsigned char*)h);
-    h[hl] = '\0';
+    h = OPENSSL_malloc(l / 2 + 1);
+    hl = from_hex(s, l, h);
   };
-  lua_pushlstring(L, (const char*)h, hl);
+  if (hl >= 0)
+    lua_pushlstring(L, (const char*)h, hl);
+  else
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, "invalid hex string");
+  }
   OPENSSL_free(h);
-  BN_free(B);
 
-  return 1;
+  return hl >= 0 ? 1 : 2;
+}
+
+static LUA_FUNCTION(openssl_base64)
+{
+  size_t l = 0, bl = 0;
+  const char* s = openssl_checklbuffer(L, 1, &l);
+  int encode = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+  int url = lua_toboolean(L, 3);
+  int ret = 1;
+  char* b = NULL;
+
+  if (encode)
+  {
+    b = OPENSSL_malloc((l + 2) / 3 * 4 + 1);
+    bl = openssl_base64_encode(s, l, b, url);
+  }
+  else
+  {
+    b = OPENSSL_malloc(l / 4 * 3 + 3);
+    ret = openssl_base64_decode(s, l, b, &bl);
+  }
+  if (ret)
+    lua_pushlstring(L, b, bl);
+  else
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, "invalid base64 string");
+  }
+  OPENSSL_free(b);
+
+  return ret ? 1 : 2;
 }
 
 static void list_callback(const OBJ_NAME *obj, void *arg)
@@ -206,6 +238,7 @@ static const luaL_Reg eay_functions[] =
   {"version",     openssl_version},
   {"list",        openssl_list},
   {"hex",         openssl_hex},
+  {"base64",      openssl_base64},
   {"mem_leaks",   openssl_mem_leaks},
 
   {"rand_status", openssl_random_status},
@@ -257,6 +290,9 @@ LUALIB_API int luaopen_openssl(lua_State*L)
   luaopen_asn1(L);
   lua_setfield(L, -2, "asn1");
 
+  luaopen_buffer(L);
+  lua_setfield(L, -2, "buffer");
+
 
   luaopen_digest(L);
   lua_setfield(L, -2, "digest");
@@ -267,6 +303,9 @@ LUALIB_API int luaopen_openssl(lua_State*L)
   luaopen_hmac(L);
   lua_setfield(L, -2, "hmac");
 
+  luaopen_kdf(L);
+  lua_setfield(L, -2, "kdf");
+
   luaopen_pkey(L);
   lua_setfield(L, -2, "pkey");
 
@@ -80,6 +80,8 @@ LUA_FUNCTION(luaopen_pkcs7);
 LUA_FUNCTION(luaopen_pkcs12);
 LUA_FUNCTION(luaopen_bio);
 LUA_FUNCTION(luaopen_asn1);
+LUA_FUNCTION(luaopen_buffer);
+LUA_FUNCTION(luaopen_kdf);
 
 LUA_FUNCTION(luaopen_ts);
 LUA_FUNCTION(luaopen_csr);
@@ -67,6 +67,10 @@ BIGNUM *BN_get(lua_State *L, int i);
 int openssl_engine(lua_State *L);
 
 void to_hex(const char* in, int length, char* out);
+unsigned long openssl_xstore_changes(void);
+int from_hex(const char* in, size_t length, char* out);
+size_t openssl_base64_encode(const char* in, size_t length, char* out, int url);
+int openssl_base64_decode(const char* in, size_t length, char* out, size_t* outlen);
 
 int openssl_push_asn1type(lua_State* L, const ASN1_TYPE* type);
 int openssl_push_asn1object(lua_State* L, const ASN1_OBJECT* obj);
@@ -94,6 +98,30 @@ int openssl_register_xstore(lua_State*L);
 
 int openssl_pushresult(lua_State*L, int result);
 
+typedef struct openssl_buffer_st
+{
+  char* data;
+  size_t len;
+  size_t cap;
+} OPENSSL_BUFFER;
+
+OPENSSL_BUFFER* openssl_tobuffer(lua_State*L, int idx);
+const char* openssl_checklbuffer(lua_State*L, int idx, size_t *len);
+int openssl_buffer_reserve(OPENSSL_BUFFER* b, size_t cap);
+
+int openssl_cpu_count(void);
+void openssl_parallel_run(void (*fn)(void*), void* jobs, size_t size, int n);
+
+typedef struct openssl_async_st OPENSSL_ASYNC;
+OPENSSL_ASYNC* openssl_async_start(void (*fn)(void*), void* arg);
+int openssl_async_done(OPENSSL_ASYNC* a);
+void openssl_async_wait(OPENSSL_ASYNC* a);
+void openssl_async_detach(OPENSSL_ASYNC* a, void (*free_fn)(void*));
+
+#define OPENSSL_FILE_CHUNK  (1024 * 1024)
+typedef int (*openssl_chunk_cb)(void* arg, const unsigned char* data, size_t len);
+int openssl_file_foreach(const char* path, size_t chunk, openssl_chunk_cb cb, void* arg);
+
 int openssl_newvalue(lua_State*L, void*p);
 int openssl_freevalue(lua_State*L, void*p);
 int openssl_setvalue(lua_State*L, void*p, const char*field);
@@ -7,13 +7,587 @@
 #include "openssl.h"
 #include "private.h"
 #include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "ssl_options.h"
+#include "ssl_dhparams.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 #define MYNAME    "ssl"
 #define MYVERSION MYNAME " library for " LUA_VERSION " / Nov 2014 / "\
   "based on OpenSSL " SHLIB_VERSION_NUMBER
 
 #include <openssl/ssl.h>
+#include <openssl/ocsp.h>
+
+static void ssl_ctx_addref(SSL_CTX* ctx)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#else
+  SSL_CTX_up_ref(ctx);
+#endif
+}
+
+/****************************TELEMETRY********************************/
+/*
+ * Counters kept in C per SSL_CTX and per SSL, fed by the info and message
+ * callbacks installed at ctx_new. A connection credits the ctx it started
+ * its handshake on, even when servername selection switches it later.
+ */
+#define STATS_HIST_BUCKETS    16
+#define STATS_VERIFY_CODES    128
+
+typedef struct ssl_stats_st
+{
+  unsigned long hs_started;
+  unsigned long hs_completed;
+  unsigned long hs_failed;
+  unsigned long resumed;
+  unsigned long renegotiations;
+  unsigned long hs_hist[STATS_HIST_BUCKETS];
+  double bytes_in;
+  double bytes_out;
+  double records_in;
+  double records_out;
+  unsigned long alerts[2][256];   /* [0] sent, [1] received */
+  unsigned long verify_errors[STATS_VERIFY_CODES];
+  long connections;
+  int enabled;
+  int trace;
+} SSL_STATS;
+
+/* handshake message times of one connection, only kept when ctx:trace(true) */
+#define TRACE_MSG_TYPES       32
+
+typedef struct ssl_trace_st
+{
+  double msg[2][TRACE_MSG_TYPES];   /* ms since handshake start, [0] sent, [1] received */
+  double lua_ms;
+  double total_ms;
+} SSL_TRACE;
+
+typedef struct ssl_ext_st
+{
+  SSL_CTX* stats_ctx;
+  SSL_STATS* stats;
+  int in_handshake;
+  unsigned long handshakes;
+  unsigned long renegotiations;
+  double hs_start;
+  double hs_time;
+  double bytes_in;
+  double bytes_out;
+  double records_in;
+  double records_out;
+  SSL_TRACE* trace;
+} SSL_EXT;
+
+static int ssl_stats_idx = -1;
+static int ssl_ext_idx = -1;
+
+/* monotonic milliseconds */
+static double ssl_clock_ms(void)
+{
+#ifdef WIN32
+  LARGE_INTEGER f, c;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&c);
+  return (double)c.QuadPart * 1000.0 / (double)f.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static void ssl_stats_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  free(ptr);
+}
+
+static void ssl_ext_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  SSL_EXT* ext = ptr;
+  if (ext)
+  {
+    if (ext->stats_ctx)
+    {
+      /* connection went away in the middle of a handshake */
+      if (ext->in_handshake)
+        ext->stats->hs_failed++;
+      ext->stats->connections--;
+      SSL_CTX_free(ext->stats_ctx);
+    }
+    free(ext->trace);
+    free(ext);
+  }
+}
+
+/* per connection state is not shared with a duplicate made by SSL_dup */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ssl_ext_dup_ex(CRYPTO_EX_DATA *to, const CRYPTO_EX_DATA *from, void **from_d, int idx, long argl, void *argp)
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+static int ssl_ext_dup_ex(CRYPTO_EX_DATA *to, const CRYPTO_EX_DATA *from, void *from_d, int idx, long argl, void *argp)
+#else
+static int ssl_ext_dup_ex(CRYPTO_EX_DATA *to, CRYPTO_EX_DATA *from, void *from_d, int idx, long argl, void *argp)
+#endif
+{
+  *(void**)from_d = NULL;
+  return 1;
+}
+
+static SSL_EXT* ssl_ext_get(const SSL* s)
+{
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  if (!ext)
+  {
+    ext = calloc(1, sizeof(SSL_EXT));
+    if (ext && !SSL_set_ex_data((SSL*)s, ssl_ext_idx, ext))
+    {
+      free(ext);
+      ext = NULL;
+    }
+  }
+  return ext;
+}
+
+static SSL_STATS* ssl_stats_get(SSL_CTX* ctx)
+{
+  return SSL_CTX_get_ex_data(ctx, ssl_stats_idx);
+}
+
+/*
+ * pin the counters of the current ctx to this connection, nothing is
+ * allocated per connection until telemetry is enabled on its ctx
+ */
+static SSL_EXT* ssl_ext_pin(const SSL* s)
+{
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  if (!ext || !ext->stats_ctx)
+  {
+    SSL_CTX* ctx = SSL_get_SSL_CTX(s);
+    SSL_STATS* stats = ssl_stats_get(ctx);
+    if (!stats || !stats->enabled || (ext = ssl_ext_get(s)) == NULL)
+      return NULL;
+    ssl_ctx_addref(ctx);
+    ext->stats_ctx = ctx;
+    ext->stats = stats;
+    stats->connections++;
+  }
+  return ext;
+}
+
+static void ssl_stats_bytes(SSL* s, int in, double n)
+{
+  SSL_EXT* ext;
+  if (n <= 0 || (ext = ssl_ext_pin(s)) == NULL)
+    return;
+  if (in)
+  {
+    ext->bytes_in += n;
+    ext->stats->bytes_in += n;
+  }
+  else
+  {
+    ext->bytes_out += n;
+    ext->stats->bytes_out += n;
+  }
+}
+
+static void ssl_info_cb(const SSL *s, int where, int ret)
+{
+  SSL_EXT* ext;
+  if (!(where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE | SSL_CB_ALERT)))
+    return;
+  ext = ssl_ext_pin(s);
+  if (!ext)
+    return;
+
+  if (where & SSL_CB_HANDSHAKE_START)
+  {
+#ifdef TLS1_3_VERSION
+    /* post-handshake messages of TLSv1.3 also start a "handshake" */
+    if (ext->handshakes > 0 && SSL_version(s) == TLS1_3_VERSION)
+      return;
+#endif
+    if (ext->handshakes > 0)
+    {
+      ext->renegotiations++;
+      ext->stats->renegotiations++;
+    }
+    ext->stats->hs_started++;
+    ext->in_handshake = 1;
+    ext->hs_start = ssl_clock_ms();
+    if (ext->stats->trace && !ext->trace)
+      ext->trace = malloc(sizeof(SSL_TRACE));
+    if (ext->trace)
+      memset(ext->trace, 0, sizeof(SSL_TRACE));
+  }
+  else if (where & SSL_CB_HANDSHAKE_DONE)
+  {
+    int i;
+    double ms;
+    if (!ext->in_handshake)
+      return;
+    ms = ssl_clock_ms() - ext->hs_start;
+    ext->in_handshake = 0;
+    ext->handshakes++;
+    ext->hs_time = ms;
+    if (ext->trace)
+      ext->trace->total_ms = ms;
+    ext->stats->hs_completed++;
+    if (SSL_session_reused((SSL*)s))
+      ext->stats->resumed++;
+    /* bucket 0 under 1ms, bucket i under 2^i ms */
+    for (i = 0; i < STATS_HIST_BUCKETS - 1 && ms >= 1.0; i++)
+      ms /= 2;
+    ext->stats->hs_hist[i]++;
+  }
+  else
+  {
+    ext->stats->alerts[(where & SSL_CB_READ) ? 1 : 0][ret & 0xff]++;
+    if ((ret >> 8) == SSL3_AL_FATAL && ext->in_handshake)
+    {
+      ext->in_handshake = 0;
+      ext->stats->hs_failed++;
+    }
+  }
+}
+
+static void ssl_msg_cb(int write_p, int version, int content_type, const void *buf, size_t len, SSL *s, void *arg)
+{
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  if (!ext || !ext->stats)
+    return;
+#ifdef SSL3_RT_HEADER
+  if (content_type == SSL3_RT_HEADER)
+  {
+    if (write_p)
+    {
+      ext->records_out++;
+      ext->stats->records_out++;
+    }
+    else
+    {
+      ext->records_in++;
+      ext->stats->records_in++;
+    }
+    return;
+  }
+#endif
+  /* first message of each handshake type, a zero time is kept distinct from unseen */
+  if (ext->trace && ext->in_handshake && content_type == SSL3_RT_HANDSHAKE && len > 0)
+  {
+    int type = ((const unsigned char*)buf)[0];
+    double* t = type < TRACE_MSG_TYPES ? &ext->trace->msg[write_p ? 0 : 1][type] : NULL;
+    if (t && *t == 0)
+    {
+      *t = ssl_clock_ms() - ext->hs_start;
+      if (*t <= 0)
+        *t = 1e-6;
+    }
+  }
+}
+
+/* lua_pcall, adding the time spent to the connection trace */
+static int ssl_trace_pcall(lua_State *L, const SSL* s, int nargs, int nresults)
+{
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  double t0;
+  int ret;
+  if (!ext || !ext->trace)
+    return lua_pcall(L, nargs, nresults, 0);
+  t0 = ssl_clock_ms();
+  ret = lua_pcall(L, nargs, nresults, 0);
+  ext->trace->lua_ms += ssl_clock_ms() - t0;
+  return ret;
+}
+
+static void ssl_stats_verify_error(X509_STORE_CTX *xctx, SSL* s)
+{
+  SSL_STATS* stats = ssl_stats_get(SSL_get_SSL_CTX(s));
+  int err = X509_STORE_CTX_get_error(xctx);
+  if (stats && stats->enabled && err != X509_V_OK)
+    stats->verify_errors[err > 0 && err < STATS_VERIFY_CODES ? err : 0]++;
+}
+
+/*
+ * Install or remove telemetry callbacks. Counters are kept when disabled,
+ * connections already pinned to them still release their reference.
+ */
+static int ssl_stats_enable(SSL_CTX* ctx, int enable)
+{
+  SSL_STATS* stats = ssl_stats_get(ctx);
+  if (!stats && enable)
+  {
+    stats = calloc(1, sizeof(SSL_STATS));
+    if (!stats)
+      return 0;
+    if (!SSL_CTX_set_ex_data(ctx, ssl_stats_idx, stats))
+    {
+      free(stats);
+      return 0;
+    }
+  }
+  if (!stats)
+    return 1;
+  stats->enabled = enable;
+  SSL_CTX_set_info_callback(ctx, enable ? ssl_info_cb : NULL);
+  SSL_CTX_set_msg_callback(ctx, enable ? ssl_msg_cb : NULL);
+  return 1;
+}
+
+static void ssl_stats_counter(lua_State*L, const char* name, double val)
+{
+  lua_pushnumber(L, val);
+  lua_setfield(L, -2, name);
+}
+
+/* ctx:stats([reset]) snapshot of counters, reset them after when asked */
+static int openssl_ssl_ctx_stats(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  int reset = lua_toboolean(L, 2);
+  SSL_STATS* stats = ssl_stats_get(ctx);
+  int i, j;
+
+  if (!stats)
+    return 0;
+  lua_newtable(L);
+  ssl_stats_counter(L, "handshakes_started", stats->hs_started);
+  ssl_stats_counter(L, "handshakes_completed", stats->hs_completed);
+  ssl_stats_counter(L, "handshakes_failed", stats->hs_failed);
+  ssl_stats_counter(L, "resumptions", stats->resumed);
+  ssl_stats_counter(L, "renegotiations", stats->renegotiations);
+  ssl_stats_counter(L, "bytes_in", stats->bytes_in);
+  ssl_stats_counter(L, "bytes_out", stats->bytes_out);
+  ssl_stats_counter(L, "records_in", stats->records_in);
+  ssl_stats_counter(L, "records_out", stats->records_out);
+  ssl_stats_counter(L, "connections", stats->connections);
+
+  lua_createtable(L, STATS_HIST_BUCKETS, 0);
+  for (i = 0; i < STATS_HIST_BUCKETS; i++)
+  {
+    lua_pushnumber(L, stats->hs_hist[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "handshake_ms");
+
+  lua_newtable(L);
+  for (j = 0; j < 2; j++)
+  {
+    lua_newtable(L);
+    for (i = 0; i < 256; i++)
+    {
+      if (stats->alerts[j][i])
+      {
+        lua_pushnumber(L, stats->alerts[j][i]);
+        lua_rawseti(L, -2, i);
+      }
+    }
+    lua_setfield(L, -2, j ? "received" : "sent");
+  }
+  lua_setfield(L, -2, "alerts");
+
+  lua_newtable(L);
+  for (i = 0; i < STATS_VERIFY_CODES; i++)
+  {
+    if (stats->verify_errors[i])
+    {
+      lua_pushnumber(L, stats->verify_errors[i]);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  lua_setfield(L, -2, "verify_errors");
+
+  if (reset)
+  {
+    /* keep settings, only counters are reset */
+    long connections = stats->connections;
+    int enabled = stats->enabled;
+    int trace = stats->trace;
+    memset(stats, 0, sizeof(SSL_STATS));
+    stats->connections = connections;
+    stats->enabled = enabled;
+    stats->trace = trace;
+  }
+  return 1;
+}
+
+/* ctx:telemetry(enable) count handshakes, bytes and records for ctx:stats */
+static int openssl_ssl_ctx_telemetry(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  SSL_STATS* stats;
+  if (!lua_isnoneornil(L, 2)
+      && !ssl_stats_enable(ctx, auxiliar_checkboolean(L, 2)))
+    return luaL_error(L, "alloc ssl stats fail");
+  stats = ssl_stats_get(ctx);
+  lua_pushboolean(L, stats && stats->enabled);
+  return 1;
+}
+
+/* ctx:trace(enable) record handshake message times of new handshakes */
+static int openssl_ssl_ctx_trace(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  SSL_STATS* stats;
+  int trace = lua_isnoneornil(L, 2) ? -1 : auxiliar_checkboolean(L, 2);
+  /* traces are taken by telemetry callbacks */
+  if (trace == 1 && !ssl_stats_enable(ctx, 1))
+    return luaL_error(L, "alloc ssl stats fail");
+  stats = ssl_stats_get(ctx);
+  if (stats && trace != -1)
+    stats->trace = trace;
+  lua_pushboolean(L, stats && stats->trace);
+  return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_NO_BUF_FREELISTS)
+#define SSL_CTX_HAS_FREELIST
+#endif
+
+/*
+ * ctx:low_memory(enable[, freelist_max]) let connections made later release
+ * their record buffers whenever they are empty, buffers are recycled through
+ * the ctx freelist that keeps at most freelist_max of them on OpenSSL 1.0.x.
+ */
+static int openssl_ssl_ctx_low_memory(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#ifdef SSL_MODE_RELEASE_BUFFERS
+  if (!lua_isnoneornil(L, 2))
+  {
+    if (auxiliar_checkboolean(L, 2))
+      SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+    else
+      SSL_CTX_clear_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_CTX_HAS_FREELIST
+    if (!lua_isnoneornil(L, 3))
+    {
+      int max = luaL_checkint(L, 3);
+      luaL_argcheck(L, max >= 0, 3, "must not be negative");
+      ctx->freelist_max_len = max;
+    }
+#endif
+  }
+  lua_pushboolean(L, (SSL_CTX_get_mode(ctx) & SSL_MODE_RELEASE_BUFFERS) != 0);
+#else
+  lua_pushboolean(L, 0);
+#endif
+#ifdef SSL_CTX_HAS_FREELIST
+  lua_pushinteger(L, ctx->freelist_max_len);
+  return 2;
+#else
+  return 1;
+#endif
+}
+
+static const struct
+{
+  int type;
+  const char* name;
+} ssl_trace_msgs[] =
+{
+  {SSL3_MT_HELLO_REQUEST,         "hello_request"},
+  {SSL3_MT_CLIENT_HELLO,          "client_hello"},
+  {SSL3_MT_SERVER_HELLO,          "server_hello"},
+#ifdef SSL3_MT_NEWSESSION_TICKET
+  {SSL3_MT_NEWSESSION_TICKET,     "new_session_ticket"},
+#endif
+#ifdef SSL3_MT_ENCRYPTED_EXTENSIONS
+  {SSL3_MT_ENCRYPTED_EXTENSIONS,  "encrypted_extensions"},
+#endif
+  {SSL3_MT_CERTIFICATE,           "certificate"},
+  {SSL3_MT_SERVER_KEY_EXCHANGE,   "server_key_exchange"},
+  {SSL3_MT_CERTIFICATE_REQUEST,   "certificate_request"},
+  {SSL3_MT_SERVER_DONE,           "server_done"},
+  {SSL3_MT_CERTIFICATE_VERIFY,    "certificate_verify"},
+  {SSL3_MT_CLIENT_KEY_EXCHANGE,   "client_key_exchange"},
+  {SSL3_MT_FINISHED,              "finished"},
+#ifdef SSL3_MT_CERTIFICATE_STATUS
+  {SSL3_MT_CERTIFICATE_STATUS,    "certificate_status"},
+#endif
+  {0, NULL}
+};
+
+/*
+ * ssl:timings() milliseconds from handshake start to the first sent and
+ * received message of each handshake type, the handshake total and time
+ * spent in lua callbacks, nil when ctx:trace was off.
+ */
+static int openssl_ssl_timings(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  int i, j;
+  if (!ext || !ext->trace)
+    return 0;
+  lua_newtable(L);
+  for (j = 0; j < 2; j++)
+  {
+    lua_newtable(L);
+    for (i = 0; ssl_trace_msgs[i].name; i++)
+    {
+      double t = ext->trace->msg[j][ssl_trace_msgs[i].type];
+      if (t > 0)
+      {
+        lua_pushnumber(L, t);
+        lua_setfield(L, -2, ssl_trace_msgs[i].name);
+      }
+    }
+    lua_setfield(L, -2, j ? "received" : "sent");
+  }
+  ssl_stats_counter(L, "lua", ext->trace->lua_ms);
+  if (ext->trace->total_ms > 0)
+    ssl_stats_counter(L, "total", ext->trace->total_ms);
+  return 1;
+}
+
+/*
+ * ssl:memory() bytes held by the connection, record and handshake buffers
+ * are only visible on OpenSSL 1.0.x where the structures are public.
+ */
+static int openssl_ssl_memory(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  double total = 0;
+  double n;
+
+  lua_newtable(L);
+  n = ext ? sizeof(SSL_EXT) + (ext->trace ? sizeof(SSL_TRACE) : 0) : 0;
+  ssl_stats_counter(L, "ext", n);
+  total += n;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if (s->s3)
+  {
+    n = s->s3->rbuf.buf ? s->s3->rbuf.len : 0;
+    ssl_stats_counter(L, "read_buffer", n);
+    total += n;
+    n = s->s3->wbuf.buf ? s->s3->wbuf.len : 0;
+    ssl_stats_counter(L, "write_buffer", n);
+    total += n;
+  }
+  n = s->init_buf ? s->init_buf->max : 0;
+  ssl_stats_counter(L, "handshake_buffer", n);
+  total += n;
+#endif
+  ssl_stats_counter(L, "total", total);
+  return 1;
+}
 
 static int openssl_ssl_ctx_new(lua_State*L)
 {
@@ -65,6 +639,20 @@ static int openssl_ssl_ctx_new(lua_State*L)
     method = DTLSv1_server_method();  /* DTLSv1.0 */
   else if (strcmp(meth, "DTLSv1_client") == 0)
     method = DTLSv1_client_method();  /* DTLSv1.0 */
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  else if (strcmp(meth, "DTLSv1_2") == 0)
+    method = DTLSv1_2_method();   /* DTLSv1.2 */
+  else if (strcmp(meth, "DTLSv1_2_server") == 0)
+    method = DTLSv1_2_server_method();  /* DTLSv1.2 */
+  else if (strcmp(meth, "DTLSv1_2_client") == 0)
+    method = DTLSv1_2_client_method();  /* DTLSv1.2 */
+  else if (strcmp(meth, "DTLS") == 0)
+    method = DTLS_method();   /* DTLSv1.0 or DTLSv1.2 */
+  else if (strcmp(meth, "DTLS_server") == 0)
+    method = DTLS_server_method();  /* DTLSv1.0 or DTLSv1.2 */
+  else if (strcmp(meth, "DTLS_client") == 0)
+    method = DTLS_client_method();  /* DTLSv1.0 or DTLSv1.2 */
+#endif
 #ifndef OPENSSL_NO_SSL2
   else if (strcmp(meth, "SSLv2") == 0)
     method = SSLv2_method();    /* SSLv2 */
@@ -75,14 +663,14 @@ static int openssl_ssl_ctx_new(lua_State*L)
 #endif
   else
     luaL_error(L, "#1:%s not supported\n"
-               "Maybe SSLv3 SSLv23 TLSv1 DTLSv1 [SSLv2], option followed by -client or -server\n",
+               "Maybe SSLv3 SSLv23 TLSv1 DTLSv1 DTLS [SSLv2], option followed by -client or -server\n",
                "default is SSLv3",
                meth);
   ciphers = luaL_optstring(L, 2, SSL_DEFAULT_CIPHER_LIST);
   ctx = SSL_CTX_new(method);
   if (!ctx)
     luaL_error(L, "#1:%s not supported\n"
-               "Maybe SSLv3 SSLv23 TLSv1 DTLSv1 [SSLv2], option followed by -client or -server\n",
+               "Maybe SSLv3 SSLv23 TLSv1 DTLSv1 DTLS [SSLv2], option followed by -client or -server\n",
                "default is SSLv3",
                meth);
   openssl_newvalue(L, ctx);
@@ -114,6 +702,41 @@ static int openssl_ssl_alert_string(lua_State*L)
   return 2;
 }
 
+/* wire a client and a server ssl object back-to-back over a BIO pair */
+static int openssl_ssl_pair(lua_State*L)
+{
+  SSL_CTX* cctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  SSL_CTX* sctx = lua_isnoneornil(L, 2) ? cctx : CHECK_OBJECT(2, SSL_CTX, "openssl.ssl_ctx");
+  int size = luaL_optint(L, 3, 0);
+  BIO *cbio = NULL, *sbio = NULL;
+  SSL *cli, *srv;
+  int ret;
+  luaL_argcheck(L, size >= 0, 3, "must not be negative");
+  ret = BIO_new_bio_pair(&cbio, size, &sbio, size);
+  if (ret != 1)
+    return openssl_pushresult(L, ret);
+
+  cli = SSL_new(cctx);
+  srv = SSL_new(sctx);
+  if (cli == NULL || srv == NULL)
+  {
+    if (cli) SSL_free(cli);
+    if (srv) SSL_free(srv);
+    BIO_free(cbio);
+    BIO_free(sbio);
+    return openssl_pushresult(L, 0);
+  }
+
+  SSL_set_bio(cli, cbio, cbio);
+  SSL_set_bio(srv, sbio, sbio);
+  SSL_set_connect_state(cli);
+  SSL_set_accept_state(srv);
+
+  PUSH_OBJECT(cli, "openssl.ssl");
+  PUSH_OBJECT(srv, "openssl.ssl");
+  return 2;
+}
+
 /****************************SSL CTX********************************/
 static int openssl_ssl_ctx_use(lua_State*L)
 {
@@ -135,56 +758,416 @@ static int openssl_ssl_ctx_use(lua_State*L)
   return openssl_pushresult(L, ret);
 }
 
-static int openssl_ssl_ctx_add(lua_State*L)
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+/*
+ * OCSP response stapled by the server, kept as DER with the time it goes
+ * stale. A handshake only copies it, fetching a fresh one is left to the lua
+ * provider called from ctx:ocsp_refresh.
+ */
+#define OCSP_STAPLE_DEFAULT_TTL   3600
+
+typedef struct ocsp_staple_st
 {
-  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
-  X509* x = CHECK_OBJECT(2, X509, "openssl.x509");
-  int ret = SSL_CTX_add_client_CA(ctx, x);
-  if (ret == 1 && !lua_isnoneornil(L, 3))
-  {
-    size_t i;
-    luaL_checktable(L, 3);
+  unsigned char* der;
+  int len;
+  time_t expire;
+} OCSP_STAPLE;
 
-    for (i = 1; ret == 1 && i <= lua_rawlen(L, 3); i++ )
-    {
-      lua_rawgeti(L, 3, i);
-      x = CHECK_OBJECT(2, X509, "openssl.x509");
-      lua_pop(L, 1);
-      ret = SSL_CTX_add_extra_chain_cert(ctx, x);
-    }
-  }
-  return openssl_pushresult(L, ret);
-}
+static int ocsp_staple_idx = -1;
 
-static int openssl_ssl_ctx_gc(lua_State*L)
+static void ocsp_staple_clear(OCSP_STAPLE* st)
 {
-  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
-  X509_STORE *xctx = SSL_CTX_get_cert_store(ctx);
-  openssl_freevalue(L, ctx);
-
-  SSL_CTX_free(ctx);
-  return 0;
+  OPENSSL_free(st->der);
+  st->der = NULL;
+  st->len = 0;
+  st->expire = 0;
 }
 
-static int openssl_ssl_ctx_timeout(lua_State*L)
+static void ocsp_staple_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
 {
-  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
-  long t;
-  if (!lua_isnoneornil(L, 2))
+  if (ptr)
   {
-    t = SSL_CTX_set_timeout(ctx, luaL_checkint(L, 2));
-    lua_pushinteger(L, t);
-    return 1;
+    ocsp_staple_clear(ptr);
+    free(ptr);
   }
-  t = SSL_CTX_get_timeout(ctx);
-  lua_pushinteger(L, t);
-  return 1;
 }
 
-static const int iMode_options[] =
+static int ocsp_status_cb(SSL *s, void *arg)
 {
-  SSL_MODE_ENABLE_PARTIAL_WRITE,
-  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER,
+  OCSP_STAPLE* st = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), ocsp_staple_idx);
+  unsigned char* p;
+
+  if (!st || !st->der || st->expire <= time(NULL))
+    return SSL_TLSEXT_ERR_NOACK;
+  p = OPENSSL_malloc(st->len);
+  if (!p)
+    return SSL_TLSEXT_ERR_NOACK;
+  memcpy(p, st->der, st->len);
+  SSL_set_tlsext_status_ocsp_resp(s, p, st->len);
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/* earliest nextUpdate of a successful response, 0 if not usable */
+static time_t ocsp_staple_expire(const unsigned char* der, long len)
+{
+  const unsigned char* p = der;
+  OCSP_RESPONSE* resp = d2i_OCSP_RESPONSE(NULL, &p, len);
+  OCSP_BASICRESP* bs = NULL;
+  time_t now = time(NULL);
+  time_t expire = 0;
+  int i, found = 0;
+
+  if (resp && OCSP_response_status(resp) == OCSP_RESPONSE_STATUS_SUCCESSFUL)
+    bs = OCSP_response_get1_basic(resp);
+  if (bs)
+  {
+    expire = now + OCSP_STAPLE_DEFAULT_TTL;
+    for (i = 0; i < OCSP_resp_count(bs); i++)
+    {
+      ASN1_GENERALIZEDTIME *thisupd = NULL, *nextupd = NULL;
+      int reason;
+      OCSP_single_get0_status(OCSP_resp_get0(bs, i), &reason, NULL, &thisupd, &nextupd);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+      if (nextupd)
+      {
+        int day, sec;
+        if (!ASN1_TIME_diff(&day, &sec, NULL, nextupd))
+        {
+          expire = 0;
+          break;
+        }
+        if (!found || now + (time_t)day * 86400 + sec < expire)
+          expire = now + (time_t)day * 86400 + sec;
+        found = 1;
+      }
+#endif
+    }
+    OCSP_BASICRESP_free(bs);
+  }
+  if (resp)
+    OCSP_RESPONSE_free(resp);
+  return expire;
+}
+
+static OCSP_STAPLE* ocsp_staple_get(SSL_CTX* ctx)
+{
+  OCSP_STAPLE* st = SSL_CTX_get_ex_data(ctx, ocsp_staple_idx);
+  if (!st)
+  {
+    st = calloc(1, sizeof(OCSP_STAPLE));
+    if (st && !SSL_CTX_set_ex_data(ctx, ocsp_staple_idx, st))
+    {
+      free(st);
+      st = NULL;
+    }
+    if (st)
+      SSL_CTX_set_tlsext_status_cb(ctx, ocsp_status_cb);
+  }
+  return st;
+}
+
+/* replace staple with DER response at idx, push result like openssl_pushresult */
+static int ocsp_staple_set(lua_State*L, SSL_CTX* ctx, int idx)
+{
+  size_t len;
+  const char* der = luaL_checklstring(L, idx, &len);
+  OCSP_STAPLE* st = ocsp_staple_get(ctx);
+  time_t expire = ocsp_staple_expire((const unsigned char*)der, len);
+  unsigned char* p;
+
+  if (!st)
+    return luaL_error(L, "alloc ocsp staple fail");
+  if (expire <= time(NULL))
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, "ocsp response not successful or expired");
+    return 2;
+  }
+  p = OPENSSL_malloc(len);
+  if (!p)
+    return luaL_error(L, "alloc ocsp staple fail");
+  memcpy(p, der, len);
+  ocsp_staple_clear(st);
+  st->der = p;
+  st->len = len;
+  st->expire = expire;
+  lua_pushnumber(L, (lua_Number)expire);
+  return 1;
+}
+
+/* call lua provider when staple is missing or stale within margin seconds */
+static int ocsp_staple_refresh(lua_State*L, SSL_CTX* ctx, long margin)
+{
+  OCSP_STAPLE* st = SSL_CTX_get_ex_data(ctx, ocsp_staple_idx);
+  int top = lua_gettop(L);
+  int ret;
+
+  if (st && st->der && st->expire - margin > time(NULL))
+  {
+    lua_pushnumber(L, (lua_Number)st->expire);
+    return 1;
+  }
+  openssl_getvalue(L, ctx, "ocsp_provider");
+  if (!lua_isfunction(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(L, "no ocsp provider");
+    return 2;
+  }
+  if (lua_pcall(L, 0, 1, 0) != 0 || !lua_isstring(L, -1))
+  {
+    if (!lua_isstring(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_pushstring(L, "ocsp provider must return DER string");
+    }
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  ret = ocsp_staple_set(L, ctx, top + 1);
+  lua_remove(L, top + 1);
+  return ret;
+}
+
+/*
+ * ctx:ocsp_staple(der) staple DER encoded OCSP response until its nextUpdate,
+ * ctx:ocsp_staple(provider) let provider() return a DER response now and on
+ * each ctx:ocsp_refresh when the staple is about to go stale.
+ */
+static int openssl_ssl_ctx_ocsp_staple(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  if (lua_isfunction(L, 2))
+  {
+    OCSP_STAPLE* st = ocsp_staple_get(ctx);
+    if (!st)
+      return luaL_error(L, "alloc ocsp staple fail");
+    lua_pushvalue(L, 2);
+    openssl_setvalue(L, ctx, "ocsp_provider");
+    ocsp_staple_clear(st);
+    return ocsp_staple_refresh(L, ctx, 0);
+  }
+  return ocsp_staple_set(L, ctx, 2);
+}
+
+/* ctx:ocsp_refresh([margin=300]) call from a timer, not during handshakes */
+static int openssl_ssl_ctx_ocsp_refresh(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  long margin = luaL_optinteger(L, 2, 300);
+  return ocsp_staple_refresh(L, ctx, margin);
+}
+
+/* staple belongs to the certificate it was issued for */
+static void ocsp_staple_invalidate(lua_State*L, SSL_CTX* ctx)
+{
+  OCSP_STAPLE* st = SSL_CTX_get_ex_data(ctx, ocsp_staple_idx);
+  if (st)
+  {
+    int top = lua_gettop(L);
+    ocsp_staple_clear(st);
+    ocsp_staple_refresh(L, ctx, 0);
+    lua_settop(L, top);
+  }
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/*
+ * Certificate, key and chain installed together by ctx:swap_cert. Each
+ * handshake takes a reference in cert_cb and copies the bundle into its own
+ * SSL, so replacing it never touches connections already in progress.
+ */
+typedef struct cert_bundle_st
+{
+  int references;
+  EVP_PKEY* pkey;
+  X509* cert;
+  STACK_OF(X509)* chain;
+} CERT_BUNDLE;
+
+typedef struct cert_slot_st
+{
+  CERT_BUNDLE* bundle;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  CRYPTO_RWLOCK* lock;
+#endif
+} CERT_SLOT;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define CERT_SLOT_LOCK(slot)    CRYPTO_w_lock(CRYPTO_LOCK_SSL_CTX)
+#define CERT_SLOT_UNLOCK(slot)  CRYPTO_w_unlock(CRYPTO_LOCK_SSL_CTX)
+#else
+#define CERT_SLOT_LOCK(slot)    CRYPTO_THREAD_write_lock((slot)->lock)
+#define CERT_SLOT_UNLOCK(slot)  CRYPTO_THREAD_unlock((slot)->lock)
+#endif
+
+static int cert_slot_idx = -1;
+
+static void cert_bundle_free(CERT_BUNDLE* b)
+{
+  EVP_PKEY_free(b->pkey);
+  X509_free(b->cert);
+  if (b->chain)
+    sk_X509_pop_free(b->chain, X509_free);
+  free(b);
+}
+
+static void cert_bundle_release(CERT_SLOT* slot, CERT_BUNDLE* b)
+{
+  int refs;
+  CERT_SLOT_LOCK(slot);
+  refs = --b->references;
+  CERT_SLOT_UNLOCK(slot);
+  if (refs == 0)
+    cert_bundle_free(b);
+}
+
+static void cert_slot_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  CERT_SLOT* slot = ptr;
+  if (slot)
+  {
+    if (slot->bundle)
+      cert_bundle_release(slot, slot->bundle);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    CRYPTO_THREAD_lock_free(slot->lock);
+#endif
+    free(slot);
+  }
+}
+
+static int cert_bundle_cb(SSL* s, void* arg)
+{
+  CERT_SLOT* slot = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), cert_slot_idx);
+  CERT_BUNDLE* b;
+  int ret;
+
+  if (!slot)
+    return 1;
+  CERT_SLOT_LOCK(slot);
+  b = slot->bundle;
+  if (b)
+    b->references++;
+  CERT_SLOT_UNLOCK(slot);
+  if (!b)
+    return 1;
+
+  ret = SSL_use_certificate(s, b->cert) == 1
+        && SSL_use_PrivateKey(s, b->pkey) == 1
+        && SSL_set1_chain(s, b->chain) == 1;
+  cert_bundle_release(slot, b);
+  return ret;
+}
+
+static int openssl_ssl_ctx_swap_cert(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  EVP_PKEY* pkey = CHECK_OBJECT(2, EVP_PKEY, "openssl.evp_pkey");
+  X509* x = CHECK_OBJECT(3, X509, "openssl.x509");
+  STACK_OF(X509)* chain = lua_isnoneornil(L, 4) ? NULL
+                          : CHECK_OBJECT(4, STACK_OF(X509), "openssl.stack_of_x509");
+  CERT_SLOT* slot;
+  CERT_BUNDLE *b, *old;
+
+  if (X509_check_private_key(x, pkey) != 1)
+    return openssl_pushresult(L, 0);
+
+  slot = SSL_CTX_get_ex_data(ctx, cert_slot_idx);
+  if (!slot)
+  {
+    slot = calloc(1, sizeof(CERT_SLOT));
+    if (!slot)
+      return luaL_error(L, "alloc cert slot fail");
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    slot->lock = CRYPTO_THREAD_lock_new();
+#endif
+    SSL_CTX_set_ex_data(ctx, cert_slot_idx, slot);
+    SSL_CTX_set_cert_cb(ctx, cert_bundle_cb, NULL);
+  }
+
+  b = calloc(1, sizeof(CERT_BUNDLE));
+  if (!b)
+    return luaL_error(L, "alloc cert bundle fail");
+  b->references = 1;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+  CRYPTO_add(&x->references, 1, CRYPTO_LOCK_X509);
+#else
+  EVP_PKEY_up_ref(pkey);
+  X509_up_ref(x);
+#endif
+  b->pkey = pkey;
+  b->cert = x;
+  b->chain = chain ? X509_chain_up_ref(chain) : NULL;
+
+  CERT_SLOT_LOCK(slot);
+  old = slot->bundle;
+  slot->bundle = b;
+  CERT_SLOT_UNLOCK(slot);
+  if (old)
+    cert_bundle_release(slot, old);
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+  ocsp_staple_invalidate(L, ctx);
+#endif
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+static int openssl_ssl_ctx_add(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  X509* x = CHECK_OBJECT(2, X509, "openssl.x509");
+  int ret = SSL_CTX_add_client_CA(ctx, x);
+  if (ret == 1 && !lua_isnoneornil(L, 3))
+  {
+    size_t i;
+    luaL_checktable(L, 3);
+
+    for (i = 1; ret == 1 && i <= lua_rawlen(L, 3); i++ )
+    {
+      lua_rawgeti(L, 3, i);
+      x = CHECK_OBJECT(2, X509, "openssl.x509");
+      lua_pop(L, 1);
+      ret = SSL_CTX_add_extra_chain_cert(ctx, x);
+    }
+  }
+  return openssl_pushresult(L, ret);
+}
+
+static int openssl_ssl_ctx_gc(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  X509_STORE *xctx = SSL_CTX_get_cert_store(ctx);
+  openssl_freevalue(L, ctx);
+
+  SSL_CTX_free(ctx);
+  return 0;
+}
+
+static int openssl_ssl_ctx_timeout(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  long t;
+  if (!lua_isnoneornil(L, 2))
+  {
+    t = SSL_CTX_set_timeout(ctx, luaL_checkint(L, 2));
+    lua_pushinteger(L, t);
+    return 1;
+  }
+  t = SSL_CTX_get_timeout(ctx);
+  lua_pushinteger(L, t);
+  return 1;
+}
+
+static const int iMode_options[] =
+{
+  SSL_MODE_ENABLE_PARTIAL_WRITE,
+  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER,
   SSL_MODE_AUTO_RETRY,
   SSL_MODE_NO_AUTO_CHAIN,
 #ifdef SSL_MODE_RELEASE_BUFFERS
@@ -288,15 +1271,71 @@ static int openssl_ssl_ctx_quiet_shutdown(lua_State*L)
   }
 };
 
+/*
+ * Successful chain verifications remembered per SSL_CTX, keyed by a SHA-256
+ * over the fingerprints of the peer leaf and untrusted chain. Entries expire
+ * at the earliest notAfter in the verified chain or after ttl seconds, and
+ * any change to the trust configuration bumps the generation to drop them all.
+ * Changes made through x509_store methods are noticed by comparing the store
+ * pointer and the store change counter on every lookup.
+ */
+typedef struct verify_entry_st
+{
+  unsigned char key[SHA256_DIGEST_LENGTH];
+  unsigned int generation;
+  time_t expire;
+} VERIFY_ENTRY;
+
+typedef struct verify_cache_st
+{
+  VERIFY_ENTRY* entries;
+  size_t size;
+  long ttl;
+  unsigned int generation;
+  X509_STORE* store;
+  unsigned long store_changes;
+  unsigned long hits;
+  unsigned long misses;
+} VERIFY_CACHE;
+
+static int verify_cache_idx = -1;
+
+static void verify_cache_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  VERIFY_CACHE* cache = ptr;
+  if (cache)
+  {
+    free(cache->entries);
+    free(cache);
+  }
+}
+
+static void verify_cache_invalidate(SSL_CTX* ctx)
+{
+  VERIFY_CACHE* cache = SSL_CTX_get_ex_data(ctx, verify_cache_idx);
+  if (cache)
+    cache->generation++;
+}
+
 static int openssl_ssl_ctx_load_verify_locations(lua_State*L)
 {
   SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
   const char* CAfile = luaL_checkstring(L, 2);
   const char* CApath = luaL_optstring(L, 3, NULL);
   int ret = SSL_CTX_load_verify_locations(ctx, CAfile, CApath);
+  verify_cache_invalidate(ctx);
   return openssl_pushresult(L, ret);
 }
 
+static void x509_store_addref(X509_STORE* store)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+#else
+  X509_STORE_up_ref(store);
+#endif
+}
+
 static int openssl_ssl_ctx_cert_store(lua_State*L)
 {
   SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
@@ -304,11 +1343,15 @@ static int openssl_ssl_ctx_cert_store(lua_State*L)
   if (!lua_isnoneornil(L, 2))
   {
     store = CHECK_OBJECT(2, X509_STORE, "openssl.x509_store");
+    /* both ssl_ctx and lua object own the store */
+    x509_store_addref(store);
     SSL_CTX_set_cert_store(ctx, store);
+    verify_cache_invalidate(ctx);
     return 0;
   }
 
   store = SSL_CTX_get_cert_store(ctx);
+  x509_store_addref(store);
   PUSH_OBJECT(store, "openssl.x509_store");
   return 1;
 }
@@ -355,7 +1398,6 @@ static int openssl_ssl_ctx_new_ssl(lua_State*L)
       SSL_set_connect_state(ssl);
 
     PUSH_OBJECT(ssl, "openssl.ssl");
-    openssl_newvalue(L,ssl);
   }else
   {
     SSL_free(ssl);
@@ -423,6 +1465,7 @@ static int verify_cb(int preverify_ok, X509_STORE_CTX *xctx)
   ssl = X509_STORE_CTX_get_ex_data(xctx,
     SSL_get_ex_data_X509_STORE_CTX_idx());
   ctx = SSL_get_SSL_CTX(ssl); 
+  ssl_stats_verify_error(xctx, ssl);
 
   L = SSL_CTX_get_app_data(ctx);
   if (L)
@@ -433,9 +1476,10 @@ static int verify_cb(int preverify_ok, X509_STORE_CTX *xctx)
       lua_pushinteger(L,preverify_ok);
       PUSH_OBJECT(xctx, "openssl.x509_store_ctx");
 
-      if (lua_pcall(L, 2, 1, 0) == 0) {
+      if (ssl_trace_pcall(L, ssl, 2, 1) == 0) {
         int rt = luaL_checkint(L, -1);
-        return luaL_checkint(L, -1);
+        lua_pop(L, 1);
+        return rt;
       }
       else
         luaL_error(L, lua_tostring(L, -1));
@@ -495,6 +1539,7 @@ static int openssl_ssl_ctx_verify_depth(lua_State*L)
   {
     depth = luaL_checkint(L, 2);
     SSL_CTX_set_verify_depth(ctx, depth);
+    verify_cache_invalidate(ctx);
   }
   depth = SSL_CTX_get_verify_depth(ctx);
   lua_pushinteger(L, depth);
@@ -543,6 +1588,7 @@ static int openssl_ssl_ctx_set_verify(lua_State*L)
     {
       SSL_CTX_set_verify(ctx, mode, verify_cb);
     }
+    verify_cache_invalidate(ctx);
 
     return 0;
   }else{
@@ -571,183 +1617,1003 @@ static int openssl_ssl_ctx_set_verify(lua_State*L)
   return 0;
 }
 
-static int cert_verify_cb(X509_STORE_CTX *xctx,void* u)
+static int cert_verify_cb(X509_STORE_CTX *xctx,void* u)
+{
+  SSL *ssl;
+  SSL_CTX *ctx;
+
+  lua_State *L = u;
+  if (L)
+  {
+    ssl = X509_STORE_CTX_get_ex_data(xctx,
+      SSL_get_ex_data_X509_STORE_CTX_idx());
+    ctx = SSL_get_SSL_CTX(ssl);
+
+    openssl_getvalue(L, ctx, "cert_verify_cb");
+    if (lua_isfunction(L, -1)) {
+      PUSH_OBJECT(xctx, "openssl.x509_store_ctx");
+      openssl_getvalue(L, ctx, "cert_verify_data");
+
+      if (ssl_trace_pcall(L, ssl, 2, 1) == 0){
+        int rt = luaL_checkint(L, -1);
+        lua_pop(L, 1);
+        return rt;
+      }
+      else
+        luaL_error(L, lua_tostring(L, -1));
+    }
+    else if(lua_istable(L,-1))
+    {
+      X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(xctx);
+      lua_getfield(L, -1, "ignore_purpose");
+      if (lua_toboolean(L, -1) && param)
+      {
+        X509_VERIFY_PARAM_set_purpose(param, X509_PURPOSE_SSL_SERVER);
+        X509_VERIFY_PARAM_set_trust(param, X509_TRUST_SSL_SERVER);
+      }
+      /* Call OpenSSL standard verification function */
+      lua_pop(L, 1);
+      return X509_verify_cert(xctx); 
+    }
+
+    return 0;
+  }
+  return 0;
+};
+
+static int verify_cache_key(X509_STORE_CTX *xctx, unsigned char key[SHA256_DIGEST_LENGTH])
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  X509* leaf = xctx->cert;
+  STACK_OF(X509)* untrusted = xctx->untrusted;
+#else
+  X509* leaf = X509_STORE_CTX_get0_cert(xctx);
+  STACK_OF(X509)* untrusted = X509_STORE_CTX_get0_untrusted(xctx);
+#endif
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = sizeof(md);
+  EVP_MD_CTX *c;
+  int i, ret;
+
+  if (!leaf)
+    return 0;
+  c = EVP_MD_CTX_create();
+  ret = c != NULL
+        && EVP_DigestInit_ex(c, EVP_sha256(), NULL)
+        && X509_digest(leaf, EVP_sha256(), md, &len)
+        && EVP_DigestUpdate(c, md, len);
+  for (i = 0; ret && untrusted && i < sk_X509_num(untrusted); i++)
+  {
+    len = sizeof(md);
+    ret = X509_digest(sk_X509_value(untrusted, i), EVP_sha256(), md, &len)
+          && EVP_DigestUpdate(c, md, len);
+  }
+  ret = ret && EVP_DigestFinal_ex(c, key, NULL);
+  if (c)
+    EVP_MD_CTX_destroy(c);
+  return ret;
+}
+
+static VERIFY_ENTRY* verify_cache_slot(VERIFY_CACHE* cache, const unsigned char* key)
+{
+  size_t h = ((size_t)key[0] << 24) | ((size_t)key[1] << 16) | ((size_t)key[2] << 8) | key[3];
+  return &cache->entries[h & (cache->size - 1)];
+}
+
+/* earliest notAfter of the verified chain, capped by now + ttl */
+static time_t verify_cache_expire(VERIFY_CACHE* cache, X509_STORE_CTX *xctx)
+{
+  time_t now = time(NULL);
+  time_t expire = now + cache->ttl;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  STACK_OF(X509)* chain = X509_STORE_CTX_get_chain(xctx);
+#else
+  STACK_OF(X509)* chain = X509_STORE_CTX_get0_chain(xctx);
+#endif
+  int i;
+  for (i = 0; chain && i < sk_X509_num(chain); i++)
+  {
+    int day, sec;
+    if (!ASN1_TIME_diff(&day, &sec, NULL, X509_get_notAfter(sk_X509_value(chain, i))))
+      return now;
+    if (now + (time_t)day * 86400 + sec < expire)
+      expire = now + (time_t)day * 86400 + sec;
+  }
+#endif
+  return expire;
+}
+
+/* host set by ssl:set_hostname_check must still match a leaf taken from cache */
+static int verify_cache_host_ok(lua_State *L, SSL *ssl, X509_STORE_CTX *xctx)
+{
+  int ret = 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  openssl_getvalue(L, ssl, "hostname_check");
+  if (lua_isstring(L, -1))
+  {
+    const char* host = lua_tostring(L, -1);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    X509* leaf = xctx->cert;
+#else
+    X509* leaf = X509_STORE_CTX_get0_cert(xctx);
+#endif
+    ret = X509_check_ip_asc(leaf, host, 0);
+    if (ret == -2)
+      ret = X509_check_host(leaf, host, lua_rawlen(L, -1), 0, NULL);
+    ret = ret == 1;
+  }
+  lua_pop(L, 1);
+#endif
+  return ret;
+}
+
+/* drop all entries when the store was replaced or changed since last lookup */
+static void verify_cache_sync(VERIFY_CACHE* cache, SSL_CTX* ctx)
+{
+  X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+  unsigned long changes = openssl_xstore_changes();
+  if (cache->store != store || cache->store_changes != changes)
+  {
+    cache->store = store;
+    cache->store_changes = changes;
+    cache->generation++;
+  }
+}
+
+static int verify_cache_cb(X509_STORE_CTX *xctx, void* u)
+{
+  SSL *ssl = X509_STORE_CTX_get_ex_data(xctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+  VERIFY_CACHE *cache = SSL_CTX_get_ex_data(ctx, verify_cache_idx);
+  lua_State *L = u;
+  unsigned char key[SHA256_DIGEST_LENGTH];
+  VERIFY_ENTRY *e = NULL;
+  int ret, lua_cb, bypass;
+
+  /* lua callbacks must see every chain, so they bypass the cache */
+  openssl_getvalue(L, ctx, "cert_verify_cb");
+  lua_cb = !lua_isnil(L, -1);
+  bypass = lua_isfunction(L, -1);
+  lua_pop(L, 1);
+  openssl_getvalue(L, ctx, "verify_cb");
+  bypass = bypass || lua_isfunction(L, -1);
+  lua_pop(L, 1);
+  if (bypass)
+    return lua_cb ? cert_verify_cb(xctx, L) : X509_verify_cert(xctx);
+
+  if (cache)
+    verify_cache_sync(cache, ctx);
+  if (cache && cache->size > 0 && verify_cache_key(xctx, key))
+  {
+    e = verify_cache_slot(cache, key);
+    if (e->generation == cache->generation && e->expire > time(NULL)
+        && memcmp(e->key, key, sizeof(key)) == 0
+        && verify_cache_host_ok(L, ssl, xctx))
+    {
+      cache->hits++;
+      X509_STORE_CTX_set_error(xctx, X509_V_OK);
+      return 1;
+    }
+    cache->misses++;
+  }
+
+  ret = lua_cb ? cert_verify_cb(xctx, L) : X509_verify_cert(xctx);
+
+  if (e && ret == 1 && X509_STORE_CTX_get_error(xctx) == X509_V_OK)
+  {
+    memcpy(e->key, key, sizeof(key));
+    e->generation = cache->generation;
+    e->expire = verify_cache_expire(cache, xctx);
+  }
+  return ret;
+}
+
+static int openssl_ssl_ctx_set_cert_verify(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  int cached = SSL_CTX_get_ex_data(ctx, verify_cache_idx) != NULL;
+  if (lua_isfunction(L, 2) || lua_istable(L, 2))
+  {
+    lua_pushvalue(L, 2);
+    if(lua_istable(L,2))
+    {
+      openssl_setvalue(L, ctx, "verify_cb_flag");
+      lua_pushvalue(L, 2);
+    }
+    openssl_setvalue(L, ctx, "cert_verify_cb");
+    lua_pushvalue(L, 3);
+    openssl_setvalue(L, ctx, "cert_verify_data");
+
+    SSL_CTX_set_cert_verify_callback(ctx, cached ? verify_cache_cb : cert_verify_cb, L);
+  }else
+  {
+    lua_pushnil(L);
+    openssl_setvalue(L, ctx, "cert_verify_cb");
+    if (cached)
+      SSL_CTX_set_cert_verify_callback(ctx, verify_cache_cb, L);
+    else
+      SSL_CTX_set_cert_verify_callback(ctx, NULL, NULL);
+  }
+  verify_cache_invalidate(ctx);
+  return 0;
+}
+
+/*
+ * ctx:verify_cache(enable[, ttl[, max]]) turns the verification cache on or
+ * off, enabling again drops all remembered chains. ctx:verify_cache() returns
+ * hits and misses.
+ */
+static int openssl_ssl_ctx_verify_cache(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  VERIFY_CACHE* cache = SSL_CTX_get_ex_data(ctx, verify_cache_idx);
+  lua_State *cbL = SSL_CTX_get_app_data(ctx);
+  int enable;
+  long ttl;
+  lua_Integer max;
+  size_t size;
+
+  if (lua_isnoneornil(L, 2))
+  {
+    lua_pushinteger(L, cache ? cache->hits : 0);
+    lua_pushinteger(L, cache ? cache->misses : 0);
+    return 2;
+  }
+  enable = auxiliar_checkboolean(L, 2);
+  ttl = luaL_optinteger(L, 3, 300);
+  max = luaL_optinteger(L, 4, 1024);
+  luaL_argcheck(L, ttl > 0, 3, "must greater than 0");
+  luaL_argcheck(L, max > 0 && max <= (1 << 24), 4, "must in range 1 to 16777216");
+
+  if (!enable)
+  {
+    if (cache)
+    {
+      SSL_CTX_set_ex_data(ctx, verify_cache_idx, NULL);
+      verify_cache_free_ex(NULL, cache, NULL, 0, 0, NULL);
+    }
+    openssl_getvalue(L, ctx, "cert_verify_cb");
+    if (lua_isnil(L, -1))
+      SSL_CTX_set_cert_verify_callback(ctx, NULL, NULL);
+    else
+      SSL_CTX_set_cert_verify_callback(ctx, cert_verify_cb, cbL);
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  for (size = 1; size < (size_t)max; size <<= 1);
+  if (!cache)
+  {
+    cache = calloc(1, sizeof(VERIFY_CACHE));
+    if (!cache)
+      return luaL_error(L, "alloc verify cache fail");
+    SSL_CTX_set_ex_data(ctx, verify_cache_idx, cache);
+  }
+  if (cache->size != size)
+  {
+    VERIFY_ENTRY* entries = calloc(size, sizeof(VERIFY_ENTRY));
+    if (!entries)
+      return luaL_error(L, "alloc verify cache fail");
+    free(cache->entries);
+    cache->entries = entries;
+    cache->size = size;
+  }
+  cache->ttl = ttl;
+  cache->generation++;
+  SSL_CTX_set_cert_verify_callback(ctx, verify_cache_cb, cbL);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/* ssl:set('hostname', name) also arms hostname verification when enabled */
+static int openssl_ssl_ctx_verify_hostname(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  if (!lua_isnoneornil(L, 2))
+  {
+    lua_pushboolean(L, auxiliar_checkboolean(L, 2));
+    openssl_setvalue(L, ctx, "verify_hostname");
+  }
+  openssl_getvalue(L, ctx, "verify_hostname");
+  lua_pushboolean(L, lua_toboolean(L, -1));
+  return 1;
+}
+#endif
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+/*
+ * Session ticket key ring shared by worker processes. Each key is 48 bytes,
+ * 16 bytes name, 16 bytes HMAC-SHA256 secret and 16 bytes AES-128 key. The
+ * first key encrypts new tickets, any key decrypts, and tickets made by an
+ * older key are renewed.
+ */
+#define TICKET_KEY_SIZE   48
+
+typedef struct ticket_keys_st
+{
+  int count;
+  unsigned char keys[1][TICKET_KEY_SIZE];
+} TICKET_KEYS;
+
+static int ticket_keys_idx = -1;
+
+static void ticket_keys_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  if (ptr)
+  {
+    TICKET_KEYS* ring = ptr;
+    OPENSSL_cleanse(ring->keys, ring->count * TICKET_KEY_SIZE);
+    free(ring);
+  }
+}
+
+static int ticket_key_cb(SSL *s, unsigned char key_name[16], unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+{
+  TICKET_KEYS* ring = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), ticket_keys_idx);
+  unsigned char* key;
+  int i;
+
+  if (!ring)
+    return enc ? -1 : 0;
+  if (enc)
+  {
+    key = ring->keys[0];
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+      return -1;
+    memcpy(key_name, key, 16);
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key + 32, iv) != 1)
+      return -1;
+    if (HMAC_Init_ex(hctx, key + 16, 16, EVP_sha256(), NULL) != 1)
+      return -1;
+    return 1;
+  }
+
+  for (i = 0; i < ring->count; i++)
+  {
+    if (memcmp(key_name, ring->keys[i], 16) == 0)
+      break;
+  }
+  /* unknown key, fall back to full handshake */
+  if (i == ring->count)
+    return 0;
+  key = ring->keys[i];
+  if (HMAC_Init_ex(hctx, key + 16, 16, EVP_sha256(), NULL) != 1)
+    return -1;
+  if (EVP_DecryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key + 32, iv) != 1)
+    return -1;
+  return i == 0 ? 1 : 2;
+}
+
+static TICKET_KEYS* ticket_keys_new(int count)
+{
+  TICKET_KEYS* ring = malloc(sizeof(TICKET_KEYS) + (count - 1) * TICKET_KEY_SIZE);
+  if (ring)
+    ring->count = count;
+  return ring;
+}
+
+static TICKET_KEYS* ticket_keys_load(const char* path)
+{
+  TICKET_KEYS* ring = NULL;
+  long size;
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+  if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0
+      && size % TICKET_KEY_SIZE == 0 && fseek(fp, 0, SEEK_SET) == 0)
+  {
+    ring = ticket_keys_new(size / TICKET_KEY_SIZE);
+    if (ring && fread(ring->keys, 1, size, fp) != (size_t)size)
+    {
+      free(ring);
+      ring = NULL;
+    }
+  }
+  fclose(fp);
+  return ring;
+}
+
+/*
+ * ctx:ticket_keys(keys) install a key ring, keys is an array of 48 bytes
+ * strings with the current key first, or path of a file holding the keys
+ * back to back, like one in /dev/shm shared by workers.
+ */
+static int openssl_ssl_ctx_ticket_keys(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  TICKET_KEYS *ring, *old = SSL_CTX_get_ex_data(ctx, ticket_keys_idx);
+  int i;
+
+  if (lua_isnoneornil(L, 2))
+  {
+    lua_pushinteger(L, old ? old->count : 0);
+    return 1;
+  }
+  if (lua_istable(L, 2))
+  {
+    int n = lua_rawlen(L, 2);
+    luaL_argcheck(L, n > 0, 2, "empty key ring");
+    for (i = 1; i <= n; i++)
+    {
+      size_t len;
+      lua_rawgeti(L, 2, i);
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "key must be string");
+      lua_tolstring(L, -1, &len);
+      luaL_argcheck(L, len == TICKET_KEY_SIZE, 2, "key must be 48 bytes");
+      lua_pop(L, 1);
+    }
+    ring = ticket_keys_new(n);
+    if (!ring)
+      return luaL_error(L, "alloc ticket keys fail");
+    for (i = 0; i < n; i++)
+    {
+      lua_rawgeti(L, 2, i + 1);
+      memcpy(ring->keys[i], lua_tostring(L, -1), TICKET_KEY_SIZE);
+      lua_pop(L, 1);
+    }
+  }
+  else
+  {
+    const char* path = luaL_checkstring(L, 2);
+    ring = ticket_keys_load(path);
+    if (!ring)
+    {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: not a ticket key file", path);
+      return 2;
+    }
+  }
+
+  SSL_CTX_set_ex_data(ctx, ticket_keys_idx, ring);
+  ticket_keys_free_ex(NULL, old, NULL, 0, 0, NULL);
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+  lua_pushinteger(L, ring->count);
+  return 1;
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+/* ALPN protocol list in wire format, length prefixed names in preference order */
+typedef struct alpn_list_st
+{
+  unsigned int len;
+  unsigned char data[1];
+} ALPN_LIST;
+
+static int alpn_list_idx = -1;
+
+static void alpn_list_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  free(ptr);
+}
+
+/* encode array of protocol names at idx, returned buffer must be freed */
+static ALPN_LIST* alpn_list_new(lua_State*L, int idx)
+{
+  ALPN_LIST* alpn;
+  int i, n;
+  unsigned int len = 0;
+
+  luaL_checktype(L, idx, LUA_TTABLE);
+  n = lua_rawlen(L, idx);
+  luaL_argcheck(L, n > 0, idx, "empty protocol list");
+  for (i = 1; i <= n; i++)
+  {
+    size_t l;
+    lua_rawgeti(L, idx, i);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, idx, "protocol must be string");
+    lua_tolstring(L, -1, &l);
+    luaL_argcheck(L, l > 0 && l < 256, idx, "protocol must be 1 to 255 bytes");
+    len += 1 + l;
+    lua_pop(L, 1);
+  }
+
+  alpn = malloc(sizeof(ALPN_LIST) + len);
+  if (!alpn)
+    luaL_error(L, "alloc alpn list fail");
+  alpn->len = 0;
+  for (i = 1; i <= n; i++)
+  {
+    size_t l;
+    const char* p;
+    lua_rawgeti(L, idx, i);
+    p = lua_tolstring(L, -1, &l);
+    alpn->data[alpn->len++] = (unsigned char)l;
+    memcpy(alpn->data + alpn->len, p, l);
+    alpn->len += l;
+    lua_pop(L, 1);
+  }
+  return alpn;
+}
+
+/* server side, pick first of our protocols the client offers */
+static int alpn_select_cb(SSL *s, const unsigned char **out, unsigned char *outlen,
+                          const unsigned char *in, unsigned int inlen, void *arg)
+{
+  ALPN_LIST* alpn = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), alpn_list_idx);
+  if (!alpn)
+    return SSL_TLSEXT_ERR_NOACK;
+  if (SSL_select_next_proto((unsigned char **)out, outlen, alpn->data, alpn->len, in, inlen)
+      != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * ctx:alpn{'h2', 'http/1.1'} set protocols in preference order, a server
+ * selects from them in C and a client offers them.
+ */
+static int openssl_ssl_ctx_alpn(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  ALPN_LIST* alpn = alpn_list_new(L, 2);
+  ALPN_LIST* old = SSL_CTX_get_ex_data(ctx, alpn_list_idx);
+  /* SSL_CTX_set_alpn_protos returns 0 on success */
+  int ret = SSL_CTX_set_alpn_protos(ctx, alpn->data, alpn->len) == 0;
+
+  SSL_CTX_set_ex_data(ctx, alpn_list_idx, alpn);
+  free(old);
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_select_cb, NULL);
+  return openssl_pushresult(L, ret);
+}
+#endif
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+/*
+ * Local anti-replay store for TLS 1.3 early data, two bloom filters of
+ * ClientHello randoms swapped every window seconds. A random seen in either
+ * one rejects early data and the client falls back to a full round trip, so
+ * a false positive only costs latency.
+ */
+#define ANTI_REPLAY_HASHES  4
+
+typedef struct anti_replay_st
+{
+  unsigned char* filter[2];   /* [0] current, [1] previous */
+  size_t bits;
+  long window;
+  time_t rotated;
+  uint32_t key[ANTI_REPLAY_HASHES];
+  unsigned long rejected;
+} ANTI_REPLAY;
+
+static int anti_replay_idx = -1;
+
+static void anti_replay_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  ANTI_REPLAY* ar = ptr;
+  if (ar)
+  {
+    free(ar->filter[0]);
+    free(ar->filter[1]);
+    free(ar);
+  }
+}
+
+static int anti_replay_check(ANTI_REPLAY* ar, const unsigned char* random)
+{
+  size_t idx[ANTI_REPLAY_HASHES];
+  time_t now = time(NULL);
+  int i, seen0 = 1, seen1 = 1;
+
+  if (now - ar->rotated >= ar->window)
+  {
+    unsigned char* t = ar->filter[1];
+    ar->filter[1] = ar->filter[0];
+    ar->filter[0] = t;
+    memset(ar->filter[0], 0, ar->bits / 8);
+    /* both filters are stale after a long idle period */
+    if (now - ar->rotated >= 2 * ar->window)
+      memset(ar->filter[1], 0, ar->bits / 8);
+    ar->rotated = now;
+  }
+
+  for (i = 0; i < ANTI_REPLAY_HASHES; i++)
+  {
+    uint32_t w;
+    memcpy(&w, random + i * 4, 4);
+    idx[i] = (w ^ ar->key[i]) % ar->bits;
+    seen0 = seen0 && (ar->filter[0][idx[i] / 8] & (1 << (idx[i] % 8)));
+    seen1 = seen1 && (ar->filter[1][idx[i] / 8] & (1 << (idx[i] % 8)));
+  }
+  if (seen0 || seen1)
+  {
+    ar->rejected++;
+    return 0;
+  }
+  for (i = 0; i < ANTI_REPLAY_HASHES; i++)
+    ar->filter[0][idx[i] / 8] |= 1 << (idx[i] % 8);
+  return 1;
+}
+
+static int allow_early_data_cb(SSL *s, void *arg)
+{
+  SSL_CTX* ctx = SSL_get_SSL_CTX(s);
+  ANTI_REPLAY* ar = SSL_CTX_get_ex_data(ctx, anti_replay_idx);
+  unsigned char random[SSL3_RANDOM_SIZE];
+  lua_State *L;
+  int ret;
+
+  if (SSL_get_client_random(s, random, sizeof(random)) != sizeof(random))
+    return 0;
+  if (ar)
+    return anti_replay_check(ar, random);
+
+  /* lua store, function(client_random) return true to accept */
+  L = SSL_CTX_get_app_data(ctx);
+  openssl_getvalue(L, ctx, "anti_replay");
+  lua_pushlstring(L, (const char*)random, sizeof(random));
+  ret = ssl_trace_pcall(L, s, 1, 1) == 0 && lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return ret;
+}
+
+/*
+ * ctx:anti_replay(bits, window) use in process bloom filters of bits each,
+ * ctx:anti_replay(store) call store(client_random) instead,
+ * ctx:anti_replay(false) remove filters or store,
+ * ctx:anti_replay() return count of early data rejected by bloom filters.
+ * While installed, tickets are reusable (SSL_OP_NO_ANTI_REPLAY) and the
+ * filters or store are the only protection against replayed early data.
+ */
+static int openssl_ssl_ctx_anti_replay(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  ANTI_REPLAY* ar = SSL_CTX_get_ex_data(ctx, anti_replay_idx);
+
+  if (lua_isnoneornil(L, 2))
+  {
+    lua_pushnumber(L, ar ? ar->rejected : 0);
+    return 1;
+  }
+  if (ar)
+  {
+    SSL_CTX_set_ex_data(ctx, anti_replay_idx, NULL);
+    anti_replay_free_ex(NULL, ar, NULL, 0, 0, NULL);
+  }
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2))
+  {
+    lua_pushnil(L);
+    openssl_setvalue(L, ctx, "anti_replay");
+    SSL_CTX_set_allow_early_data_cb(ctx, NULL, NULL);
+#ifdef SSL_OP_NO_ANTI_REPLAY
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+#endif
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  if (lua_isfunction(L, 2))
+  {
+    lua_pushvalue(L, 2);
+    openssl_setvalue(L, ctx, "anti_replay");
+  }
+  else
+  {
+    lua_Integer bits = luaL_checkinteger(L, 2);
+    long window = luaL_optinteger(L, 3, 10);
+    luaL_argcheck(L, bits >= 64, 2, "must be at least 64");
+    luaL_argcheck(L, window > 0, 3, "must greater than 0");
+
+    ar = calloc(1, sizeof(ANTI_REPLAY));
+    if (!ar)
+      return luaL_error(L, "alloc anti replay store fail");
+    ar->bits = (size_t)(bits + 7) / 8 * 8;
+    ar->window = window;
+    ar->rotated = time(NULL);
+    ar->filter[0] = calloc(ar->bits / 8, 1);
+    ar->filter[1] = calloc(ar->bits / 8, 1);
+    if (!ar->filter[0] || !ar->filter[1]
+        || RAND_bytes((unsigned char*)ar->key, sizeof(ar->key)) != 1)
+    {
+      anti_replay_free_ex(NULL, ar, NULL, 0, 0, NULL);
+      return luaL_error(L, "alloc anti replay store fail");
+    }
+    SSL_CTX_set_ex_data(ctx, anti_replay_idx, ar);
+  }
+  SSL_CTX_set_allow_early_data_cb(ctx, allow_early_data_cb, NULL);
+#ifdef SSL_OP_NO_ANTI_REPLAY
+  /* replace the single use ticket check, which stateless tickets lack */
+  SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+#endif
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int openssl_ssl_ctx_max_early_data(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  if (!lua_isnoneornil(L, 2))
+  {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0, 2, "must not be negative");
+    SSL_CTX_set_max_early_data(ctx, (uint32_t)n);
+  }
+  lua_pushinteger(L, SSL_CTX_get_max_early_data(ctx));
+  return 1;
+}
+#endif
+
+#ifndef OPENSSL_NO_DTLS
+/*
+ * Stateless DTLS cookies, HMAC-SHA256 over the peer address keyed by a
+ * ctx secret. The previous secret still verifies after a rotation so that
+ * clients in the middle of a cookie exchange are not dropped.
+ */
+#define DTLS_COOKIE_LEN     32
+
+typedef struct dtls_cookie_st
+{
+  unsigned char secret[2][32];  /* [0] current, [1] previous */
+  int rotated;
+} DTLS_COOKIE;
+
+static int dtls_cookie_idx = -1;
+
+static void dtls_cookie_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  DTLS_COOKIE* dc = ptr;
+  if (dc)
+  {
+    OPENSSL_cleanse(dc, sizeof(DTLS_COOKIE));
+    free(dc);
+  }
+}
+
+static int dtls_cookie_hmac(SSL* s, const unsigned char* secret, unsigned char* out)
+{
+  unsigned char peer[256];
+  unsigned int len = DTLS_COOKIE_LEN;
+  long n;
+
+  memset(peer, 0, sizeof(peer));
+  n = BIO_ctrl(SSL_get_rbio(s), BIO_CTRL_DGRAM_GET_PEER, 0, peer);
+  /* no peer address, such as a bio pair, must not share one cookie */
+  if (n <= 0)
+    return 0;
+  if (n > (long)sizeof(peer))
+    n = sizeof(peer);
+  return HMAC(EVP_sha256(), secret, 32, peer, n, out, &len) != NULL;
+}
+
+static int dtls_cookie_generate_cb(SSL* s, unsigned char *cookie, unsigned int *cookie_len)
+{
+  DTLS_COOKIE* dc = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), dtls_cookie_idx);
+  if (!dc || !dtls_cookie_hmac(s, dc->secret[0], cookie))
+    return 0;
+  *cookie_len = DTLS_COOKIE_LEN;
+  return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static int dtls_cookie_verify_cb(SSL* s, const unsigned char *cookie, unsigned int cookie_len)
+#else
+static int dtls_cookie_verify_cb(SSL* s, unsigned char *cookie, unsigned int cookie_len)
+#endif
+{
+  DTLS_COOKIE* dc = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), dtls_cookie_idx);
+  unsigned char expect[DTLS_COOKIE_LEN];
+  int i;
+
+  if (!dc || cookie_len != DTLS_COOKIE_LEN)
+    return 0;
+  for (i = 0; i <= dc->rotated; i++)
+  {
+    if (dtls_cookie_hmac(s, dc->secret[i], expect)
+        && CRYPTO_memcmp(expect, cookie, DTLS_COOKIE_LEN) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * ctx:dtls_cookie([secret]) set or rotate cookie secret, random one if
+ * omitted, and install cookie callbacks for ssl:dtls_listen.
+ */
+static int openssl_ssl_ctx_dtls_cookie(lua_State*L)
 {
-  SSL *ssl;
-  SSL_CTX *ctx;
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  DTLS_COOKIE* dc = SSL_CTX_get_ex_data(ctx, dtls_cookie_idx);
+  size_t len = 0;
+  const char* secret = luaL_optlstring(L, 2, NULL, &len);
 
-  lua_State *L = u;
-  if (L)
+  if (dc == NULL)
   {
-    ssl = X509_STORE_CTX_get_ex_data(xctx,
-      SSL_get_ex_data_X509_STORE_CTX_idx());
-    ctx = SSL_get_SSL_CTX(ssl);
+    dc = calloc(1, sizeof(DTLS_COOKIE));
+    if (!dc)
+      return luaL_error(L, "alloc dtls cookie fail");
+    SSL_CTX_set_ex_data(ctx, dtls_cookie_idx, dc);
+  }
+  else
+  {
+    memcpy(dc->secret[1], dc->secret[0], sizeof(dc->secret[0]));
+    dc->rotated = 1;
+  }
 
-    openssl_getvalue(L, ctx, "cert_verify_cb");
-    if (lua_isfunction(L, -1)) {
-      PUSH_OBJECT(xctx, "openssl.x509_store_ctx");
-      openssl_getvalue(L, ctx, "cert_verify_data");
+  if (secret)
+    SHA256((const unsigned char*)secret, len, dc->secret[0]);
+  else if (RAND_bytes(dc->secret[0], sizeof(dc->secret[0])) != 1)
+    return openssl_pushresult(L, 0);
 
-      if (lua_pcall(L, 2, 1, 0) == 0){
-        int rt = luaL_checkint(L, -1);
-        lua_pop(L, 1);
-        return rt;
-      }
-      else
-        luaL_error(L, lua_tostring(L, -1));
-    }
-    else if(lua_istable(L,-1))
-    {
-      X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(xctx);
-      lua_getfield(L, -1, "ignore_purpose");
-      if (lua_toboolean(L, -1) && param)
-      {
-        X509_VERIFY_PARAM_set_purpose(param, X509_PURPOSE_SSL_SERVER);
-        X509_VERIFY_PARAM_set_trust(param, X509_TRUST_SSL_SERVER);
-      }
-      /* Call OpenSSL standard verification function */
-      lua_pop(L, 1);
-      return X509_verify_cert(xctx); 
-    }
+  SSL_CTX_set_cookie_generate_cb(ctx, dtls_cookie_generate_cb);
+  SSL_CTX_set_cookie_verify_cb(ctx, dtls_cookie_verify_cb);
+  SSL_CTX_set_options(ctx, SSL_OP_COOKIE_EXCHANGE);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
 
-    return 0;
-  }
-  return 0;
+/*
+ * Parsed results of the lua tmp key callbacks, kept per SSL_CTX and keyed by
+ * (is_export, keylength), so a handshake only reaches lua on first use.
+ * OpenSSL copies or references what the callback returns, the cache owns it.
+ */
+#define TMP_CACHE_SIZE  8
+
+enum { TMP_KEY_DH, TMP_KEY_RSA, TMP_KEY_ECDH, TMP_KEY_MAX };
+
+typedef struct tmp_entry_st
+{
+  int is_export;
+  int keylength;
+  void* key;
+} TMP_ENTRY;
+
+typedef struct tmp_cache_st
+{
+  TMP_ENTRY keys[TMP_KEY_MAX][TMP_CACHE_SIZE];
+  int next[TMP_KEY_MAX];
+} TMP_CACHE;
+
+static const char* tmp_callback_names[TMP_KEY_MAX] =
+{
+  "tmp_dh_callback",
+  "tmp_rsa_callback",
+  "tmp_ecdh_callback"
 };
 
-static int openssl_ssl_ctx_set_cert_verify(lua_State*L)
+static int tmp_cache_idx = -1;
+
+static const char* ssl_ffdhe_pem(const char* name)
 {
-  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
-  if (lua_isfunction(L, 2) || lua_istable(L, 2))
+  int i;
+  for (i = 0; ssl_ffdhe_groups[i].name; i++)
   {
-    lua_pushvalue(L, 2);
-    if(lua_istable(L,2))
-    {
-      openssl_setvalue(L, ctx, "verify_cb_flag");
-      lua_pushvalue(L, 2);
-    }
-    openssl_setvalue(L, ctx, "cert_verify_cb");
-    lua_pushvalue(L, 3);
-    openssl_setvalue(L, ctx, "cert_verify_data");
-
-    SSL_CTX_set_cert_verify_callback(ctx, cert_verify_cb, L);
-  }else
-    SSL_CTX_set_cert_verify_callback(ctx, NULL, NULL);
-  return 0;
+    if (strcmp(ssl_ffdhe_groups[i].name, name) == 0)
+      return ssl_ffdhe_groups[i].pem;
+  }
+  return NULL;
 }
 
-static DH *tmp_dh_callback(SSL *ssl, int is_export, int keylength)
+static void tmp_key_free(int which, void* key)
 {
-  BIO *bio;
-  DH *dh_tmp = NULL;
-  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
-  lua_State *L = SSL_CTX_get_app_data(ctx);
-  int ret = 0;
-  /* get callback function */
-  openssl_getvalue(L, ctx, "tmp_dh_callback");
+  if (which == TMP_KEY_DH)
+    DH_free(key);
+  else if (which == TMP_KEY_RSA)
+    RSA_free(key);
+  else
+    EC_KEY_free(key);
+}
 
-  /* Invoke the callback */
-  lua_pushboolean(L, is_export);
-  lua_pushnumber(L, keylength);
-  ret = lua_pcall(L, 2, 1, 0);
-  if (ret==0)
-  {
-    /* Load parameters from returned value */
-    if (lua_type(L, -1) != LUA_TSTRING) {
-      lua_pop(L, 2);  /* Remove values from stack */
-      return NULL;
-    }
-    bio = BIO_new_mem_buf((void*)lua_tostring(L, -1), 
-      lua_rawlen(L, -1));
-    if (bio) {
-      dh_tmp = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-      BIO_free(bio);
-    }
-  }else
+static void tmp_cache_clear(TMP_CACHE* cache, int which)
+{
+  int i;
+  for (i = 0; i < TMP_CACHE_SIZE; i++)
   {
-    lua_error(L);
+    if (cache->keys[which][i].key)
+      tmp_key_free(which, cache->keys[which][i].key);
   }
+  memset(cache->keys[which], 0, sizeof(cache->keys[which]));
+  cache->next[which] = 0;
+}
 
-
-  lua_pop(L, 2);    /* Remove values from stack */
-  return dh_tmp;
+static void tmp_cache_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  TMP_CACHE* cache = ptr;
+  if (cache)
+  {
+    int which;
+    for (which = 0; which < TMP_KEY_MAX; which++)
+      tmp_cache_clear(cache, which);
+    free(cache);
+  }
 }
 
-static RSA *tmp_rsa_callback(SSL *ssl, int is_export, int keylength)
+static void* tmp_key_parse(int which, const char* data, size_t len)
 {
   BIO *bio;
-  RSA *rsa_tmp = NULL;
-  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
-  lua_State *L = SSL_CTX_get_app_data(ctx);
-  int ret = 0;
-  /* get callback function */
-  openssl_getvalue(L, ctx, "tmp_rsa_callback");
-
-  /* Invoke the callback */
-  lua_pushboolean(L, is_export);
-  lua_pushnumber(L, keylength);
-  ret = lua_pcall(L, 2, 1, 0);
-  if (ret==0)
+  void* key = NULL;
+  const char* pem = which == TMP_KEY_DH ? ssl_ffdhe_pem(data) : NULL;
+  if (pem)
   {
-    /* Load parameters from returned value */
-    if (lua_type(L, -1) != LUA_TSTRING) {
-      lua_pop(L, 2);  /* Remove values from stack */
-      return NULL;
-    }
-    bio = BIO_new_mem_buf((void*)lua_tostring(L, -1), 
-      lua_rawlen(L, -1));
-    if (bio) {
-      
-      rsa_tmp = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
-      BIO_free(bio);
-    }
-  }else
+    data = pem;
+    len = strlen(pem);
+  }
+  bio = BIO_new_mem_buf((void*)data, len);
+  if (bio)
   {
-    lua_error(L);
+    if (which == TMP_KEY_DH)
+      key = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+    else if (which == TMP_KEY_RSA)
+      key = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
+    else
+      key = PEM_read_bio_ECPrivateKey(bio, NULL, NULL, NULL);
+    BIO_free(bio);
   }
-
-
-  lua_pop(L, 2);    /* Remove values from stack */
-  return rsa_tmp;
+  return key;
 }
 
-
-static EC_KEY *tmp_ecdh_callback(SSL *ssl, int is_export, int keylength)
+static void* tmp_key_callback(SSL *ssl, int which, int is_export, int keylength)
 {
-  BIO *bio;
-  EC_KEY *ec_tmp = NULL;
   SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
   lua_State *L = SSL_CTX_get_app_data(ctx);
-  int ret = 0;
+  TMP_CACHE *cache = SSL_CTX_get_ex_data(ctx, tmp_cache_idx);
+  void *key = NULL;
+  int i;
+
+  if (cache)
+  {
+    for (i = 0; i < TMP_CACHE_SIZE; i++)
+    {
+      TMP_ENTRY *k = &cache->keys[which][i];
+      if (k->key && k->is_export == is_export && k->keylength == keylength)
+        return k->key;
+    }
+  }
+
   /* get callback function */
-  openssl_getvalue(L, ctx, "tmp_ecdh_callback");
+  openssl_getvalue(L, ctx, tmp_callback_names[which]);
 
   /* Invoke the callback */
   lua_pushboolean(L, is_export);
   lua_pushnumber(L, keylength);
-  ret = lua_pcall(L, 2, 1, 0);
-  if (ret==0)
-  {
-    /* Load parameters from returned value */
-    if (lua_type(L, -1) != LUA_TSTRING) {
-      lua_pop(L, 2);  /* Remove values from stack */
-      return NULL;
-    }
-    bio = BIO_new_mem_buf((void*)lua_tostring(L, -1), 
-      lua_rawlen(L, -1));
-    if (bio) {
+  if (ssl_trace_pcall(L, ssl, 2, 1) != 0)
+    lua_error(L);
 
-      ec_tmp = PEM_read_bio_ECPrivateKey(bio, NULL, NULL, NULL);
-      BIO_free(bio);
-    }
-  }else
+  /* Load parameters from returned value */
+  if (lua_type(L, -1) == LUA_TSTRING)
+    key = tmp_key_parse(which, lua_tostring(L, -1), lua_rawlen(L, -1));
+  lua_pop(L, 1);
+
+  if (key)
   {
-    lua_error(L);
+    if (!cache)
+    {
+      cache = calloc(1, sizeof(TMP_CACHE));
+      if (!cache || !SSL_CTX_set_ex_data(ctx, tmp_cache_idx, cache))
+      {
+        /* out of memory, key is left unowned */
+        free(cache);
+        return key;
+      }
+    }
+    i = cache->next[which];
+    if (cache->keys[which][i].key)
+      tmp_key_free(which, cache->keys[which][i].key);
+    cache->keys[which][i].is_export = is_export;
+    cache->keys[which][i].keylength = keylength;
+    cache->keys[which][i].key = key;
+    cache->next[which] = (i + 1) % TMP_CACHE_SIZE;
   }
+  return key;
+}
+
+static DH *tmp_dh_callback(SSL *ssl, int is_export, int keylength)
+{
+  return tmp_key_callback(ssl, TMP_KEY_DH, is_export, keylength);
+}
 
+static RSA *tmp_rsa_callback(SSL *ssl, int is_export, int keylength)
+{
+  return tmp_key_callback(ssl, TMP_KEY_RSA, is_export, keylength);
+}
 
-  lua_pop(L, 2);    /* Remove values from stack */
-  return ec_tmp;
+static EC_KEY *tmp_ecdh_callback(SSL *ssl, int is_export, int keylength)
+{
+  return tmp_key_callback(ssl, TMP_KEY_ECDH, is_export, keylength);
 }
 
 static int openssl_ssl_ctx_set_tmp(lua_State *L)
@@ -763,6 +2629,10 @@ static int openssl_ssl_ctx_set_tmp(lua_State *L)
   int nwhich = luaL_checkoption(L, 2, NULL, which);
 
   if(lua_isfunction(L,3)) {
+    TMP_CACHE* cache = SSL_CTX_get_ex_data(ctx, tmp_cache_idx);
+    /* results of previous callback are stale now */
+    if (cache)
+      tmp_cache_clear(cache, nwhich);
     lua_pushvalue(L, 3);
     switch (nwhich)
     {
@@ -787,14 +2657,18 @@ static int openssl_ssl_ctx_set_tmp(lua_State *L)
   }
   else if(lua_isstring(L, 3))
   {
-    BIO* bio = load_bio_object(L, 3);
+    const char* pem = nwhich == 0 ? ssl_ffdhe_pem(lua_tostring(L, 3)) : NULL;
+    BIO* bio = pem ? BIO_new_mem_buf((void*)pem, strlen(pem)) : load_bio_object(L, 3);
     switch (nwhich)
     {
     case 0:
       {
         DH* dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
         if(dh)
+        {
           SSL_CTX_set_tmp_dh(ctx, dh);
+          DH_free(dh);
+        }
         else
           luaL_error(L,"generate new tmp dh fail");
       }
@@ -803,7 +2677,10 @@ static int openssl_ssl_ctx_set_tmp(lua_State *L)
       {
         RSA* rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
         if(rsa)
+        {
           SSL_CTX_set_tmp_rsa(ctx, rsa);
+          RSA_free(rsa);
+        }
         else
           luaL_error(L,"generate new tmp rsa fail");
       }
@@ -819,7 +2696,10 @@ static int openssl_ssl_ctx_set_tmp(lua_State *L)
             ec = EC_KEY_new_by_curve_name(nid);
         }
         if(ec)
+        {
           SSL_CTX_set_tmp_ecdh(ctx, ec);
+          EC_KEY_free(ec);
+        }
         else
           luaL_error(L,"generate new tmp ec_key fail");
       }
@@ -836,17 +2716,244 @@ static int openssl_ssl_ctx_set_tmp(lua_State *L)
   return 0;
 }
 
+/* C side index of servername to SSL_CTX, consulted before any lua callback */
+typedef struct sni_entry_st
+{
+  char* name;
+  unsigned long hash;
+  SSL_CTX* ctx;
+  struct sni_entry_st* next;
+} SNI_ENTRY;
+
+typedef struct sni_table_st
+{
+  SNI_ENTRY** buckets;
+  size_t size;
+  size_t count;
+} SNI_TABLE;
+
+typedef struct sni_map_st
+{
+  SNI_TABLE exact;
+  SNI_TABLE wildcard;   /* keyed by the suffix after "*." */
+} SNI_MAP;
+
+static int sni_map_idx = -1;
+
+static unsigned long sni_hash(const char* name)
+{
+  unsigned long h = 2166136261UL;
+  while (*name)
+  {
+    h ^= (unsigned char) * name++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/* lowercase name into buf and strip a trailing dot, 0 if it does not fit */
+static int sni_normalize(const char* name, char* buf, size_t len)
+{
+  size_t i;
+  for (i = 0; name[i] && i < len - 1; i++)
+    buf[i] = (char)tolower((unsigned char)name[i]);
+  if (name[i])
+    return 0;
+  if (i > 0 && buf[i - 1] == '.')
+    i--;
+  buf[i] = 0;
+  return i > 0;
+}
+
+static SNI_ENTRY** sni_table_slot(SNI_TABLE* t, const char* name, unsigned long h)
+{
+  SNI_ENTRY** p;
+  if (t->size == 0)
+    return NULL;
+  p = &t->buckets[h & (t->size - 1)];
+  while (*p && ((*p)->hash != h || strcmp((*p)->name, name) != 0))
+    p = &(*p)->next;
+  return p;
+}
+
+static SSL_CTX* sni_table_find(SNI_TABLE* t, const char* name)
+{
+  SNI_ENTRY** p = sni_table_slot(t, name, sni_hash(name));
+  return (p && *p) ? (*p)->ctx : NULL;
+}
+
+static int sni_table_grow(SNI_TABLE* t)
+{
+  size_t size = t->size ? t->size * 2 : 64;
+  SNI_ENTRY** buckets = calloc(size, sizeof(SNI_ENTRY*));
+  size_t i;
+  if (!buckets)
+    return 0;
+  for (i = 0; i < t->size; i++)
+  {
+    SNI_ENTRY* e = t->buckets[i];
+    while (e)
+    {
+      SNI_ENTRY* next = e->next;
+      e->next = buckets[e->hash & (size - 1)];
+      buckets[e->hash & (size - 1)] = e;
+      e = next;
+    }
+  }
+  free(t->buckets);
+  t->buckets = buckets;
+  t->size = size;
+  return 1;
+}
+
+static int sni_table_put(SNI_TABLE* t, const char* name, SSL_CTX* ctx)
+{
+  unsigned long h = sni_hash(name);
+  SNI_ENTRY** p;
+  SNI_ENTRY* e;
+
+  if (t->count >= t->size && !sni_table_grow(t))
+    return 0;
+  p = sni_table_slot(t, name, h);
+  ssl_ctx_addref(ctx);
+  if (*p)
+  {
+    SSL_CTX_free((*p)->ctx);
+    (*p)->ctx = ctx;
+    return 1;
+  }
+  e = malloc(sizeof(SNI_ENTRY) + strlen(name) + 1);
+  if (!e)
+  {
+    SSL_CTX_free(ctx);
+    return 0;
+  }
+  e->name = (char*)(e + 1);
+  strcpy(e->name, name);
+  e->hash = h;
+  e->ctx = ctx;
+  e->next = NULL;
+  *p = e;
+  t->count++;
+  return 1;
+}
+
+static int sni_table_del(SNI_TABLE* t, const char* name)
+{
+  SNI_ENTRY** p = sni_table_slot(t, name, sni_hash(name));
+  SNI_ENTRY* e;
+  if (!p || !*p)
+    return 0;
+  e = *p;
+  *p = e->next;
+  SSL_CTX_free(e->ctx);
+  free(e);
+  t->count--;
+  return 1;
+}
+
+static void sni_table_clear(SNI_TABLE* t)
+{
+  size_t i;
+  for (i = 0; i < t->size; i++)
+  {
+    SNI_ENTRY* e = t->buckets[i];
+    while (e)
+    {
+      SNI_ENTRY* next = e->next;
+      SSL_CTX_free(e->ctx);
+      free(e);
+      e = next;
+    }
+  }
+  free(t->buckets);
+  memset(t, 0, sizeof(SNI_TABLE));
+}
+
+static void sni_map_free_ex(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  SNI_MAP* map = ptr;
+  if (map)
+  {
+    sni_table_clear(&map->exact);
+    sni_table_clear(&map->wildcard);
+    free(map);
+  }
+}
+
+static SNI_MAP* sni_map_get(SSL_CTX* ctx, int create)
+{
+  SNI_MAP* map = SSL_CTX_get_ex_data(ctx, sni_map_idx);
+  if (!map && create)
+  {
+    map = calloc(1, sizeof(SNI_MAP));
+    if (map)
+      SSL_CTX_set_ex_data(ctx, sni_map_idx, map);
+  }
+  return map;
+}
+
+/* exact name first, then the wildcard entry covering its leftmost label */
+static SSL_CTX* sni_map_lookup(SNI_MAP* map, const char* name)
+{
+  char host[256];
+  SSL_CTX* ctx;
+  const char* dot;
+
+  if (!sni_normalize(name, host, sizeof(host)))
+    return NULL;
+  ctx = sni_table_find(&map->exact, host);
+  if (!ctx && map->wildcard.count > 0)
+  {
+    dot = strchr(host, '.');
+    if (dot && dot[1])
+      ctx = sni_table_find(&map->wildcard, dot + 1);
+  }
+  return ctx;
+}
+
+/* check hostname at nidx and ssl_ctx at cidx, normalized name goes to host */
+static SSL_CTX* sni_map_check(lua_State*L, int nidx, int cidx, char* host, size_t len)
+{
+  luaL_checktype(L, nidx, LUA_TSTRING);
+  if (!sni_normalize(lua_tostring(L, nidx), host, len))
+    luaL_argerror(L, nidx, "invalid hostname");
+  if (host[0] == '*' && host[1] == '.')
+    luaL_argcheck(L, host[2] != 0, nidx, "invalid hostname");
+  return CHECK_OBJECT(cidx, SSL_CTX, "openssl.ssl_ctx");
+}
+
+static int sni_map_put(SNI_MAP* map, const char* host, SSL_CTX* target)
+{
+  if (host[0] == '*' && host[1] == '.')
+    return sni_table_put(&map->wildcard, host + 2, target);
+  return sni_table_put(&map->exact, host, target);
+}
+
 static int tlsext_servername_callback(SSL *ssl, int *ad, void *arg)
 {
   SSL_CTX *newctx = NULL;
   SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
   lua_State *L = SSL_CTX_get_app_data(ctx);
   const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  SNI_MAP *map;
 
   /* No name, use default context */
   if (!name)
     return SSL_TLSEXT_ERR_NOACK;
 
+  /* Search for the name in the C index */
+  map = sni_map_get(ctx, 0);
+  if (map)
+  {
+    newctx = sni_map_lookup(map, name);
+    if (newctx)
+    {
+      SSL_set_SSL_CTX(ssl, newctx);
+      return SSL_TLSEXT_ERR_OK;
+    }
+  }
+
   /* Search for the name in the map */
   openssl_getvalue(L, ctx, "tlsext_servername");
   if (lua_istable(L,-1))
@@ -859,10 +2966,31 @@ static int tlsext_servername_callback(SSL *ssl, int *ad, void *arg)
       lua_pop(L, 2);
       return SSL_TLSEXT_ERR_OK;
     }
-  }else if(lua_isfunction(L, -1))
-  {
-  }else
+    lua_pop(L, 1);
+  }else if(lua_isfunction(L, -1))
+  {
+    /* function(servername) return ssl_ctx, or nil to keep current */
+    lua_pushstring(L, name);
+    if (ssl_trace_pcall(L, ssl, 1, 1) == 0)
+    {
+      if (auxiliar_isclass(L,"openssl.ssl_ctx", -1))
+      {
+        newctx = CHECK_OBJECT(-1, SSL_CTX, "openssl.ssl_ctx");
+        SSL_set_SSL_CTX(ssl, newctx);
+        lua_pop(L, 1);
+        return SSL_TLSEXT_ERR_OK;
+      }
+      else if (lua_isnil(L, -1))
+      {
+        lua_pop(L, 1);
+        return SSL_TLSEXT_ERR_NOACK;
+      }
+    }
+  }else if (map)
   {
+    /* only C index installed, miss keeps default context */
+    lua_pop(L, 1);
+    return SSL_TLSEXT_ERR_NOACK;
   }
 
   lua_pop(L, 1);
@@ -880,6 +3008,92 @@ static int openssl_ssl_ctx_set_servername_callback(lua_State*L)
   return 0;
 }
 
+/*
+ * ctx:sni_map(map) replaces the C servername index with map, a table of
+ * hostname to ssl_ctx, '*.example.com' entries match one leftmost label.
+ * Without map, return the number of exact and wildcard entries.
+ */
+static int openssl_ssl_ctx_sni_map(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  SNI_MAP* map;
+  SNI_MAP tmp;
+  char host[256];
+  if (lua_isnoneornil(L, 2))
+  {
+    map = sni_map_get(ctx, 0);
+    lua_pushinteger(L, map ? map->exact.count : 0);
+    lua_pushinteger(L, map ? map->wildcard.count : 0);
+    return 2;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  /* check all entries first, a bad one leaves the installed map untouched */
+  lua_pushnil(L);
+  while (lua_next(L, 2) != 0)
+  {
+    sni_map_check(L, -2, -1, host, sizeof(host));
+    lua_pop(L, 1);
+  }
+  map = sni_map_get(ctx, 1);
+  if (!map)
+    return luaL_error(L, "alloc sni map fail");
+
+  memset(&tmp, 0, sizeof(tmp));
+  lua_pushnil(L);
+  while (lua_next(L, 2) != 0)
+  {
+    SSL_CTX* target = sni_map_check(L, -2, -1, host, sizeof(host));
+    if (!sni_map_put(&tmp, host, target))
+    {
+      sni_table_clear(&tmp.exact);
+      sni_table_clear(&tmp.wildcard);
+      return luaL_error(L, "add %s to sni map fail", host);
+    }
+    lua_pop(L, 1);
+  }
+  sni_table_clear(&map->exact);
+  sni_table_clear(&map->wildcard);
+  *map = tmp;
+  SSL_CTX_set_tlsext_servername_callback(ctx, tlsext_servername_callback);
+  lua_pushinteger(L, map->exact.count + map->wildcard.count);
+  return 1;
+}
+
+static int openssl_ssl_ctx_sni_add(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  char host[256];
+  SSL_CTX* target = sni_map_check(L, 2, 3, host, sizeof(host));
+  SNI_MAP* map = sni_map_get(ctx, 1);
+  if (!map)
+    return luaL_error(L, "alloc sni map fail");
+  if (!sni_map_put(map, host, target))
+    return luaL_error(L, "add %s to sni map fail", host);
+  SSL_CTX_set_tlsext_servername_callback(ctx, tlsext_servername_callback);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int openssl_ssl_ctx_sni_remove(lua_State*L)
+{
+  SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+  const char* name = luaL_checkstring(L, 2);
+  SNI_MAP* map = sni_map_get(ctx, 0);
+  char host[256];
+  int ret = 0;
+
+  if (map && sni_normalize(name, host, sizeof(host)))
+  {
+    if (host[0] == '*' && host[1] == '.')
+      ret = sni_table_del(&map->wildcard, host + 2);
+    else
+      ret = sni_table_del(&map->exact, host);
+  }
+  lua_pushboolean(L, ret);
+  return 1;
+}
+
 static int openssl_ssl_ctx_flush_sessions(lua_State*L)
 {
   SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
@@ -922,6 +3136,9 @@ static luaL_Reg ssl_ctx_funcs[] =
   {"bio",             openssl_ssl_ctx_new_bio},
 
   {"use",             openssl_ssl_ctx_use},
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  {"swap_cert",       openssl_ssl_ctx_swap_cert},
+#endif
   {"add",             openssl_ssl_ctx_add},
   {"mode",            openssl_ssl_ctx_mode},
   {"timeout",         openssl_ssl_ctx_timeout},
@@ -932,7 +3149,35 @@ static luaL_Reg ssl_ctx_funcs[] =
 
   {"set_verify",         openssl_ssl_ctx_set_verify},
   {"set_cert_verify",    openssl_ssl_ctx_set_cert_verify},
+  {"verify_cache",       openssl_ssl_ctx_verify_cache},
+  {"stats",              openssl_ssl_ctx_stats},
+  {"telemetry",          openssl_ssl_ctx_telemetry},
+  {"trace",              openssl_ssl_ctx_trace},
+  {"low_memory",         openssl_ssl_ctx_low_memory},
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+  {"ticket_keys",        openssl_ssl_ctx_ticket_keys},
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+  {"alpn",               openssl_ssl_ctx_alpn},
+#endif
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+  {"ocsp_staple",        openssl_ssl_ctx_ocsp_staple},
+  {"ocsp_refresh",       openssl_ssl_ctx_ocsp_refresh},
+#endif
+#ifndef OPENSSL_NO_DTLS
+  {"dtls_cookie",        openssl_ssl_ctx_dtls_cookie},
+#endif
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  {"max_early_data",     openssl_ssl_ctx_max_early_data},
+  {"anti_replay",        openssl_ssl_ctx_anti_replay},
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  {"verify_hostname",    openssl_ssl_ctx_verify_hostname},
+#endif
   {"set_servername_callback",    openssl_ssl_ctx_set_servername_callback},
+  {"sni_map",         openssl_ssl_ctx_sni_map},
+  {"sni_add",         openssl_ssl_ctx_sni_add},
+  {"sni_remove",      openssl_ssl_ctx_sni_remove},
   
   {"verify_depth",    openssl_ssl_ctx_verify_depth},  
   {"set_tmp",         openssl_ssl_ctx_set_tmp},
@@ -1399,6 +3644,32 @@ static int openssl_ssl_get(lua_State*L)
   return top - 1;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/* peer certificate must match host, an IP literal is checked against iPAddress */
+static int ssl_set_hostname_check(lua_State*L, SSL* s, const char* host)
+{
+  X509_VERIFY_PARAM *param = SSL_get0_param(s);
+  int ret;
+  X509_VERIFY_PARAM_set_hostflags(param, 0);
+  ret = X509_VERIFY_PARAM_set1_ip_asc(param, host);
+  if (ret != 1)
+    ret = X509_VERIFY_PARAM_set1_host(param, host, strlen(host));
+  if (ret == 1)
+  {
+    lua_pushstring(L, host);
+    openssl_setvalue(L, s, "hostname_check");
+  }
+  return ret;
+}
+
+static int openssl_ssl_set_hostname_check(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  const char* host = luaL_checkstring(L, 2);
+  return openssl_pushresult(L, ssl_set_hostname_check(L, s, host));
+}
+#endif
+
 static int openssl_ssl_set(lua_State*L)
 {
   SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
@@ -1462,6 +3733,12 @@ static int openssl_ssl_set(lua_State*L)
     {
       const char* hostname =luaL_checkstring(L, i+1);
       SSL_set_tlsext_host_name(s,hostname);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+      openssl_getvalue(L, SSL_get_SSL_CTX(s), "verify_hostname");
+      if (lua_toboolean(L, -1))
+        ret = ssl_set_hostname_check(L, s, hostname);
+      lua_pop(L, 1);
+#endif
     }
     
 #if OPENSSL_VERSION_NUMBER > 0x10000000L
@@ -1494,17 +3771,256 @@ static int openssl_ssl_connect(lua_State*L)
   return openssl_ssl_pushresult(L, s, ret);
 }
 
+static int openssl_ssl_stats(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  SSL_EXT* ext = SSL_get_ex_data(s, ssl_ext_idx);
+  SSL_EXT zero;
+  if (!ext)
+  {
+    memset(&zero, 0, sizeof(zero));
+    ext = &zero;
+  }
+  lua_newtable(L);
+  ssl_stats_counter(L, "handshakes", ext->handshakes);
+  ssl_stats_counter(L, "renegotiations", ext->renegotiations);
+  ssl_stats_counter(L, "handshake_ms", ext->hs_time);
+  ssl_stats_counter(L, "bytes_in", ext->bytes_in);
+  ssl_stats_counter(L, "bytes_out", ext->bytes_out);
+  ssl_stats_counter(L, "records_in", ext->records_in);
+  ssl_stats_counter(L, "records_out", ext->records_out);
+  return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+/* ssl:alpn{...} protocols a client offers on this connection */
+static int openssl_ssl_alpn(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  ALPN_LIST* alpn = alpn_list_new(L, 2);
+  int ret = SSL_set_alpn_protos(s, alpn->data, alpn->len) == 0;
+  free(alpn);
+  return openssl_pushresult(L, ret);
+}
+
+static int openssl_ssl_alpn_selected(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  const unsigned char* data = NULL;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected(s, &data, &len);
+  if (!data || len == 0)
+    return 0;
+  lua_pushlstring(L, (const char*)data, len);
+  return 1;
+}
+#endif
+
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+/*
+ * ssl:ocsp_staple(true) ask server for stapled OCSP response before handshake,
+ * ssl:ocsp_staple() return DER response received, or nil.
+ */
+static int openssl_ssl_ocsp_staple(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  const unsigned char* der = NULL;
+  long len;
+  if (!lua_isnoneornil(L, 2))
+  {
+    int ret = 1;
+    if (auxiliar_checkboolean(L, 2))
+      ret = SSL_set_tlsext_status_type(s, TLSEXT_STATUSTYPE_ocsp);
+    return openssl_pushresult(L, ret);
+  }
+  len = SSL_get_tlsext_status_ocsp_resp(s, &der);
+  if (!der || len <= 0)
+    return 0;
+  lua_pushlstring(L, (const char*)der, len);
+  return 1;
+}
+#endif
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+/* client, send data in 0-RTT before handshake completes, needs resumed session */
+static int openssl_ssl_write_early_data(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  size_t size, written = 0;
+  const char* buf = luaL_checklstring(L, 2, &size);
+  int ret = SSL_write_early_data(s, buf, size, &written);
+  if (ret == 1)
+  {
+    ssl_stats_bytes(s, 0, (double)written);
+    lua_pushinteger(L, written);
+    return 1;
+  }
+  return openssl_ssl_pushresult(L, s, ret);
+}
+
+/* server, read early data before handshake, false and 'finish' when no more */
+static int openssl_ssl_read_early_data(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  int num = luaL_optint(L, 2, 4096);
+  size_t readbytes = 0;
+  void* buf;
+  int ret;
+
+  luaL_argcheck(L, num > 0, 2, "must greater than 0");
+  buf = malloc(num);
+  if (!buf)
+    return luaL_error(L, "alloc early data buffer fail");
+  ret = SSL_read_early_data(s, buf, num, &readbytes);
+  if (ret == SSL_READ_EARLY_DATA_SUCCESS)
+  {
+    ssl_stats_bytes(s, 1, (double)readbytes);
+    lua_pushlstring(L, buf, readbytes);
+    free(buf);
+    return 1;
+  }
+  free(buf);
+  if (ret == SSL_READ_EARLY_DATA_FINISH)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "finish");
+    return 2;
+  }
+  return openssl_ssl_pushresult(L, s, -1);
+}
+
+static int openssl_ssl_early_data_status(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  int status = SSL_get_early_data_status(s);
+  if (status == SSL_EARLY_DATA_ACCEPTED)
+    lua_pushstring(L, "accepted");
+  else if (status == SSL_EARLY_DATA_REJECTED)
+    lua_pushstring(L, "rejected");
+  else
+    lua_pushstring(L, "not_sent");
+  return 1;
+}
+#endif
+
+#ifndef OPENSSL_NO_DTLS
+/* seconds until DTLS retransmit timer expires, nil when no timer running */
+static int openssl_ssl_dtls_timeout(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  struct timeval tv;
+  if (DTLSv1_get_timeout(s, &tv) != 1)
+    return 0;
+  lua_pushnumber(L, tv.tv_sec + tv.tv_usec / 1000000.0);
+  return 1;
+}
+
+/* retransmit handshake flight when timer expired, return true if sent */
+static int openssl_ssl_handle_timeout(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  int ret = DTLSv1_handle_timeout(s);
+  if (ret < 0)
+    return openssl_ssl_pushresult(L, s, ret);
+  lua_pushboolean(L, ret);
+  return 1;
+}
+
+/*
+ * server, answer ClientHello without cookie by HelloVerifyRequest and keep
+ * no state, return true when a ClientHello with valid cookie arrived.
+ */
+static int openssl_ssl_dtls_listen(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  int ret;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  BIO_ADDR *peer = BIO_ADDR_new();
+  if (!peer)
+    return luaL_error(L, "alloc peer address fail");
+  ret = DTLSv1_listen(s, peer);
+  if (ret == 1)
+  {
+    char *host = BIO_ADDR_hostname_string(peer, 1);
+    char *serv = BIO_ADDR_service_string(peer, 1);
+    lua_pushboolean(L, 1);
+    if (host && serv)
+    {
+      lua_pushstring(L, host);
+      lua_pushinteger(L, atoi(serv));
+    }
+    OPENSSL_free(host);
+    OPENSSL_free(serv);
+    BIO_ADDR_free(peer);
+    return lua_gettop(L) - 1;
+  }
+  BIO_ADDR_free(peer);
+#else
+  unsigned char peer[256];
+  ret = DTLSv1_listen(s, peer);
+  if (ret == 1)
+  {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+#endif
+  if (ret == 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "want_read");
+    return 2;
+  }
+  return openssl_ssl_pushresult(L, s, ret);
+}
+
+/* set path MTU in bytes and stop querying it from socket */
+static int openssl_ssl_mtu(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  long mtu = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, mtu > 0, 2, "must greater than 0");
+  SSL_set_options(s, SSL_OP_NO_QUERY_MTU);
+  lua_pushboolean(L, SSL_set_mtu(s, mtu) == 1);
+  return 1;
+}
+#endif
+
 static int openssl_ssl_read(lua_State*L)
 {
   SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
-  int num = luaL_optint(L, 2, SSL_pending(s));
+  OPENSSL_BUFFER* ob = openssl_tobuffer(L, 2);
+  int num;
   void* buf;
   int ret;
+
+  if (ob)
+  {
+    /* append to buffer, up to its spare capacity by default */
+    size_t spare = ob->cap - ob->len;
+    num = luaL_optint(L, 3, spare ? (int)spare : 4096);
+    luaL_argcheck(L, num > 0, 3, "must greater than 0");
+    if (!openssl_buffer_reserve(ob, ob->len + num))
+      return luaL_error(L, "alloc buffer fail");
+    ret = SSL_read(s, ob->data + ob->len, num);
+    if (ret > 0)
+    {
+      ssl_stats_bytes(s, 1, ret);
+      ob->len += ret;
+      lua_pushinteger(L, ret);
+      return 1;
+    }
+    lua_pushnil(L);
+    lua_pushinteger(L, ret);
+    return 2;
+  }
+
+  num = luaL_optint(L, 2, SSL_pending(s));
   num = num ? num : 4096;
   buf = malloc(num);
   ret = SSL_read(s, buf, num);
   if (ret > 0)
   {
+    ssl_stats_bytes(s, 1, ret);
     lua_pushlstring(L, buf, ret);
     ret =  1;
   }
@@ -1537,10 +4053,11 @@ static int openssl_ssl_write(lua_State*L)
 {
   SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
   size_t size;
-  const char* buf = luaL_checklstring(L, 2, &size);
+  const char* buf = openssl_checklbuffer(L, 2, &size);
   int ret = SSL_write(s, buf, size);
   if (ret > 0)
   {
+    ssl_stats_bytes(s, 0, ret);
     lua_pushinteger(L, ret);
     return 1;
   }
@@ -1551,6 +4068,155 @@ static int openssl_ssl_write(lua_State*L)
   return 0;
 }
 
+#ifdef SSL_OP_ENABLE_KTLS
+static int openssl_ssl_ktls(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  lua_pushboolean(L, BIO_get_ktls_send(SSL_get_wbio(s)));
+  lua_pushboolean(L, BIO_get_ktls_recv(SSL_get_rbio(s)));
+  return 2;
+}
+#endif
+
+static int ssl_pread(int fd, void* buf, size_t n, double offset)
+{
+#ifdef WIN32
+  if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+    return -1;
+  return _read(fd, buf, (unsigned int)n);
+#else
+  return (int)pread(fd, buf, n, (off_t)offset);
+#endif
+}
+
+/*
+ * Stream file content into the connection without creating Lua strings.
+ * Data goes through SSL_sendfile when kernel TLS send is active, otherwise
+ * chunks are pread into one buffer and passed to SSL_write. On want_read or
+ * want_write the bytes already sent are returned, call again with the
+ * offset and length advanced by that amount to resume. A resumed write
+ * passes the same bytes from a new buffer, so accept_moving_write_buffer
+ * mode is turned on while the call runs and restored before it returns.
+ */
+static int openssl_ssl_sendfile(lua_State*L)
+{
+  SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+  double offset = luaL_optnumber(L, 3, 0);
+  double length = luaL_optnumber(L, 4, -1);
+  int chunk = luaL_optint(L, 5, SSL3_RT_MAX_PLAIN_LENGTH);
+  double sent = 0;
+  int fd = -1;
+  int own = 0;
+  int ret = 1;
+  int rerr = -1;
+  char* buf = NULL;
+
+  luaL_argcheck(L, offset >= 0, 3, "must not be negative");
+  luaL_argcheck(L, chunk > 0, 5, "must greater than 0");
+  if (lua_type(L, 2) == LUA_TNUMBER)
+    fd = lua_tointeger(L, 2);
+  else
+  {
+    const char* path = luaL_checkstring(L, 2);
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(errno));
+      return 2;
+    }
+    own = 1;
+  }
+  if (length < 0)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      if (own)
+        close(fd);
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(errno));
+      return 2;
+    }
+    length = st.st_size > offset ? st.st_size - offset : 0;
+  }
+
+#ifdef SSL_OP_ENABLE_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(s)))
+  {
+    while (sent < length)
+    {
+      ossl_ssize_t n = SSL_sendfile(s, fd, (off_t)(offset + sent), (size_t)(length - sent), 0);
+      if (n <= 0)
+      {
+        ret = (int)n;
+        break;
+      }
+      sent += n;
+      ssl_stats_bytes(s, 0, (double)n);
+    }
+  }
+  else
+#endif
+  {
+    long mode = SSL_get_mode(s);
+    buf = malloc(chunk);
+    if (buf == NULL)
+    {
+      if (own)
+        close(fd);
+      return luaL_error(L, "alloc sendfile buffer fail");
+    }
+    SSL_set_mode(s, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    while (sent < length)
+    {
+      int n = (length - sent) > chunk ? chunk : (int)(length - sent);
+      n = ssl_pread(fd, buf, n, offset + sent);
+      if (n <= 0)
+      {
+        rerr = n == 0 ? 0 : errno;
+        break;
+      }
+      ret = SSL_write(s, buf, n);
+      if (ret <= 0)
+        break;
+      sent += ret;
+      ssl_stats_bytes(s, 0, ret);
+    }
+    if (!(mode & SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER))
+      SSL_clear_mode(s, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    free(buf);
+  }
+  if (own)
+    close(fd);
+
+  if (rerr >= 0)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, rerr == 0 ? "eof" : strerror(rerr));
+    lua_pushnumber(L, sent);
+    return 3;
+  }
+  if (ret > 0)
+  {
+    lua_pushnumber(L, sent);
+    return 1;
+  }
+  else
+  {
+    int err = SSL_get_error(s, ret);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+    {
+      lua_pushnumber(L, sent);
+      lua_pushstring(L, err == SSL_ERROR_WANT_WRITE ? "want_write" : "want_read");
+      return 2;
+    }
+    ret = openssl_ssl_pushresult(L, s, ret);
+    lua_pushnumber(L, sent);
+    return ret + 1;
+  }
+}
+
 static int openssl_ssl_error(lua_State*L)
 {
   SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
@@ -1750,6 +4416,9 @@ static luaL_Reg ssl_funcs[] =
   {"current_cipher",        openssl_ssl_current_cipher},
   {"current_compression",   openssl_ssl_current_compression},
   {"getpeerverification",   openssl_ssl_getpeerverification},
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  {"set_hostname_check",    openssl_ssl_set_hostname_check},
+#endif
   
   {"session",    openssl_ssl_session},
 
@@ -1765,6 +4434,31 @@ static luaL_Reg ssl_funcs[] =
   {"read",      openssl_ssl_read},
   {"peek",      openssl_ssl_peek},
   {"write",     openssl_ssl_write},
+#ifndef OPENSSL_NO_DTLS
+  {"dtls_timeout",      openssl_ssl_dtls_timeout},
+  {"handle_timeout",    openssl_ssl_handle_timeout},
+  {"dtls_listen",       openssl_ssl_dtls_listen},
+  {"mtu",               openssl_ssl_mtu},
+#endif
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  {"write_early_data",  openssl_ssl_write_early_data},
+  {"read_early_data",   openssl_ssl_read_early_data},
+  {"early_data_status", openssl_ssl_early_data_status},
+#endif
+  {"stats",     openssl_ssl_stats},
+  {"timings",   openssl_ssl_timings},
+  {"memory",    openssl_ssl_memory},
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+  {"ocsp_staple",   openssl_ssl_ocsp_staple},
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+  {"alpn",          openssl_ssl_alpn},
+  {"alpn_selected", openssl_ssl_alpn_selected},
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+  {"ktls",      openssl_ssl_ktls},
+#endif
+  {"sendfile",  openssl_ssl_sendfile},
   {"error",     openssl_ssl_error},
 
   {"renegotiate",       openssl_ssl_renegotiate},
@@ -1790,6 +4484,7 @@ static luaL_reg R[] =
 {
   {"ctx_new",       openssl_ssl_ctx_new },
   {"alert_string",  openssl_ssl_alert_string },
+  {"pair",          openssl_ssl_pair },
 
   {"session_new",   openssl_ssl_session_new},
   {"session_read",  openssl_ssl_session_read},
@@ -1802,6 +4497,40 @@ int luaopen_ssl(lua_State *L)
 
   SSL_load_error_strings();
   SSLeay_add_ssl_algorithms();
+  if (sni_map_idx < 0)
+    sni_map_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, sni_map_free_ex);
+  if (ssl_stats_idx < 0)
+    ssl_stats_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ssl_stats_free_ex);
+  if (ssl_ext_idx < 0)
+    ssl_ext_idx = SSL_get_ex_new_index(0, NULL, NULL, ssl_ext_dup_ex, ssl_ext_free_ex);
+#ifndef OPENSSL_NO_DTLS
+  if (dtls_cookie_idx < 0)
+    dtls_cookie_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, dtls_cookie_free_ex);
+#endif
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  if (anti_replay_idx < 0)
+    anti_replay_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, anti_replay_free_ex);
+#endif
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+  if (ocsp_staple_idx < 0)
+    ocsp_staple_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ocsp_staple_free_ex);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+  if (alpn_list_idx < 0)
+    alpn_list_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, alpn_list_free_ex);
+#endif
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+  if (ticket_keys_idx < 0)
+    ticket_keys_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ticket_keys_free_ex);
+#endif
+  if (verify_cache_idx < 0)
+    verify_cache_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, verify_cache_free_ex);
+  if (tmp_cache_idx < 0)
+    tmp_cache_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, tmp_cache_free_ex);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  if (cert_slot_idx < 0)
+    cert_slot_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, cert_slot_free_ex);
+#endif
 
   auxiliar_newclass(L, "openssl.ssl_ctx",       ssl_ctx_funcs);
   auxiliar_newclass(L, "openssl.ssl_session",   ssl_session_funcs);
@@ -14,6 +14,13 @@ int openssl_freevalue(lua_State*L, void*p) {
 
 int openssl_setvalue(lua_State*L, void*p, const char*field){
   lua_rawgetp(L, LUA_REGISTRYINDEX, p);
+  /* value table is created on first use */
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, p);
+  }
   lua_pushvalue(L, -2);
   lua_remove(L, -3);
   lua_setfield(L, -2, field);
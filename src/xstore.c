@@ -10,6 +10,14 @@
 
 #define MYNAME "x509.store"
 
+/* bumped by every method that changes a store, see ssl verify cache */
+static unsigned long xstore_changes = 0;
+
+unsigned long openssl_xstore_changes(void)
+{
+  return xstore_changes;
+}
+
 static int openssl_xstore_gc(lua_State* L)
 {
   X509_STORE* ctx = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
@@ -42,6 +50,7 @@ static int openssl_xstore_add_lookup(lua_State* L)
     }
   }
 
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -51,6 +60,7 @@ static int openssl_xstore_depth(lua_State* L)
   X509_STORE* ctx = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
   int depth = luaL_checkint(L, 2);
   int ret = X509_STORE_set_depth(ctx, depth);
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -59,6 +69,7 @@ static int openssl_xstore_flags(lua_State* L)
   X509_STORE* ctx = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
   int flags = luaL_checkint(L, 2);
   int ret = X509_STORE_set_flags(ctx, flags);
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -67,6 +78,7 @@ static int openssl_xstore_purpose(lua_State* L)
   X509_STORE* ctx = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
   int purpose = luaL_checkint(L, 2);
   int ret = X509_STORE_set_purpose(ctx, purpose);
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -75,6 +87,7 @@ static int openssl_xstore_trust(lua_State* L)
   X509_STORE* ctx = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
   int trust = auxiliar_checkboolean(L, 2);
   int ret = X509_STORE_set_trust(ctx, trust);
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -89,6 +102,7 @@ static int openssl_xstore_load(lua_State* L)
   }else
     ret = X509_STORE_set_default_paths(ctx);
 
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -98,21 +112,22 @@ static int openssl_xstore_add(lua_State* L)
   int n = lua_gettop(L);
   int i;
   int ret = 1;
-  for(i=2; i<n  && ret==1; i++) {
+  for(i=2; i<=n  && ret==1; i++) {
     if(lua_istable(L, i)) {
       int k = lua_rawlen(L, i);
       int j;
       for(j=1;j<=k;j++) {
         lua_rawgeti(L,i,j);
-        if(auxiliar_isclass(L, "openssl.x509", i)) {
-          X509* x = CHECK_OBJECT(i, X509, "openssl.x509");
+        if(auxiliar_isclass(L, "openssl.x509", -1)) {
+          X509* x = CHECK_OBJECT(-1, X509, "openssl.x509");
           ret = X509_STORE_add_cert(ctx,x);
-        }else if(auxiliar_isclass(L, "openssl.x509_crl", i)) {
-          X509_CRL* c = CHECK_OBJECT(i, X509_CRL, "openssl.x509_crl");
+        }else if(auxiliar_isclass(L, "openssl.x509_crl", -1)) {
+          X509_CRL* c = CHECK_OBJECT(-1, X509_CRL, "openssl.x509_crl");
           ret = X509_STORE_add_crl(ctx,c);
         }else{
           luaL_argerror(L, i, "only accept table with x509 or x509_crl object");
         }
+        lua_pop(L, 1);
       }
     }else if(auxiliar_isclass(L, "openssl.x509", i)) {
       X509* x = CHECK_OBJECT(i, X509, "openssl.x509");
@@ -125,6 +140,7 @@ static int openssl_xstore_add(lua_State* L)
     }
   }
 
+  xstore_changes++;
   return openssl_pushresult(L, ret);
 }
 
@@ -1,29 +1,76 @@
-local openssl = require('openssl')
-
-TestLhtml = {}
-
-    function testAll()
-        local f = io.open('openssl.cnf','r') 
-        if not f then f = io.open('test/openssl.cnf','r') end
-        if f then
-            local data = f:read('*a')
-            f:close()
-            local conf = assert(openssl.lhash_read(data))
-            local t = conf:parse(false)
-            assertIsTable(t)
-            --print_r(t)
-            local t = conf:parse()
-            assertIsTable(t)
-
-            local t = conf:parse(true)
-            assertIsTable(t)
-            
-            assert(conf:get_string('ca','default_ca'))
-            assert(conf:get_string('CA_default','default_days'))
-            
-            local c1 = openssl.lhash_load('openssl.cnf') or openssl.lhash_load('test/openssl.cnf')
-            t = c1:parse()
-            assertIsTable(t)
-        end
-    end
-    
+local openssl = require('openssl')
+
+TestLhtml = {}
+
+    function testAll()
+        local f = io.open('openssl.cnf','r') 
+        if not f then f = io.open('test/openssl.cnf','r') end
+        if f then
+            local data = f:read('*a')
+            f:close()
+            local conf = assert(openssl.lhash_read(data))
+            local t = conf:parse(false)
+            assertIsTable(t)
+            --print_r(t)
+            local t = conf:parse()
+            assertIsTable(t)
+
+            local t = conf:parse(true)
+            assertIsTable(t)
+            
+            assert(conf:get_string('ca','default_ca'))
+            assert(conf:get_string('CA_default','default_days'))
+            
+            local c1 = openssl.lhash_load('openssl.cnf') or openssl.lhash_load('test/openssl.cnf')
+            t = c1:parse()
+            assertIsTable(t)
+        end
+    end
+    
+
+
+TestCodec = {}
+
+    function TestCodec:testHex()
+        local raw = '\0\1\127\128\255' .. string.rep('\171', 40)
+        local hex = openssl.hex(raw)
+        assertEquals(hex, '00017f80ff' .. string.rep('ab', 40))
+        assertEquals(openssl.hex(hex, false), raw)
+        assertEquals(openssl.hex(hex:upper(), false), raw)
+        assertEquals(openssl.hex('', false), '')
+        assertIsNil(openssl.hex('abc', false))
+        assertIsNil(openssl.hex('zz', false))
+        assertIsNil(openssl.hex(string.rep('ab', 5) .. 'zz' .. string.rep('ab', 20), false))
+        assertIsNil(openssl.hex(string.rep('ab', 5) .. '\128\128' .. string.rep('ab', 20), false))
+    end
+
+    function TestCodec:testBase64()
+        local cases = {
+            {'', ''}, {'f', 'Zg=='}, {'fo', 'Zm8='}, {'foo', 'Zm9v'},
+            {'foob', 'Zm9vYg=='}, {'fooba', 'Zm9vYmE='}, {'foobar', 'Zm9vYmFy'}
+        }
+        for _, v in ipairs(cases) do
+            assertEquals(openssl.base64(v[1]), v[2])
+            assertEquals(openssl.base64(v[2], false), v[1])
+            assertEquals(openssl.base64(v[1], true, true), (v[2]:gsub('=', '')))
+            assertEquals(openssl.base64((v[2]:gsub('=', '')), false), v[1])
+        end
+        assertEquals(openssl.base64('\251\255', true, true), '-_8')
+        assertEquals(openssl.base64('-_8', false), '\251\255')
+        assertEquals(openssl.base64('Zm9v\nYmFy\n', false), 'foobar')
+        assertIsNil(openssl.base64('Z', false))
+        assertIsNil(openssl.base64('Zm9v*', false))
+        assertIsNil(openssl.base64('Zg==Zg', false))
+
+        local bits = string.rep('\251\255\191', 8)
+        assertEquals(openssl.base64(bits), string.rep('+/+/', 8))
+        assertEquals(openssl.base64(bits, true, true), string.rep('-_-_', 8))
+        assertEquals(openssl.base64(string.rep('+/-_', 8), false), bits)
+        assertEquals(openssl.base64('Zm9vYmFy\nZm9vYmFyZm9vYmFy', false), string.rep('foobar', 3))
+        assertIsNil(openssl.base64('Zm9vYmFyZm9v*mFyZm9vYmFy', false))
+
+        local raw = openssl.random(1000)
+        assertEquals(openssl.base64(openssl.base64(raw), false), raw)
+        assertEquals(openssl.base64(openssl.base64(raw, true, true), false), raw)
+        assertEquals(openssl.base64(openssl.buffer.new(raw)), openssl.base64(raw))
+    end
@@ -69,3 +69,62 @@ TestDigestMY = {}
         assert(t1.size==20)
     end
 
+
+TestDigestFile = {}
+    function TestDigestFile:setUp()
+        self.path = os.tmpname()
+        self.msg = string.rep('0123456789abcdef', 80000)
+        local f = assert(io.open(self.path, 'wb'))
+        f:write(self.msg)
+        f:close()
+    end
+
+    function TestDigestFile:tearDown()
+        os.remove(self.path)
+    end
+
+    function TestDigestFile:testFile()
+        assertEquals(digest.file('sha256', self.path), digest.digest('sha256', self.msg))
+        assertEquals(digest.get('sha1'):file(self.path, true), digest.digest('sha1', self.msg, true))
+        assertEquals(digest.file('sha256', self.path..'.missing'), nil)
+    end
+
+    function TestDigestFile:testMulti()
+        local algs = {'md5', 'sha1', digest.get('sha256')}
+        local a, b, c = digest.multi(algs, self.msg)
+        assertEquals(a, digest.digest('md5', self.msg))
+        assertEquals(b, digest.digest('sha1', self.msg))
+        assertEquals(c, digest.digest('sha256', self.msg))
+
+        local f = assert(io.open(self.path, 'rb'))
+        local a1, b1, c1 = digest.multi(algs, f, true)
+        f:close()
+        assertEquals(a1, digest.digest('md5', self.msg, true))
+        assertEquals(c1, digest.digest('sha256', self.msg, true))
+
+        local mem = require'openssl'.bio.mem(self.msg)
+        assertEquals(select(2, digest.multi(algs, mem)), b)
+
+        local m = digest.multi_new(algs)
+        assert(m:update(self.msg:sub(1, 1000)))
+        assert(m:update(self.msg:sub(1001)))
+        local a2, b2, c2 = m:final()
+        assertEquals(a2, a)
+        assertEquals(b2, b)
+        assertEquals(c2, c)
+    end
+
+    function TestDigestFile:testTree()
+        local opts = {leaf=4096, threads=4, leaves=true}
+        local root, leaves = digest.tree('sha256', self.msg, opts)
+        assertEquals(#leaves, math.ceil(#self.msg / 4096))
+        assertEquals(leaves[1], digest.digest('sha256', '\0'..self.msg:sub(1, 4096), true))
+        assertEquals(digest.tree_root('sha256', leaves), root)
+        assertEquals(digest.tree('sha256', self.msg, {leaf=4096, threads=1}), root)
+        assertEquals(digest.tree_file('sha256', self.path, opts), root)
+
+        local l1, l2 = digest.digest('sha256', '\0a', true), digest.digest('sha256', '\0b', true)
+        assertEquals(digest.tree_root('sha256', {l1, l2}, true),
+                     digest.digest('sha256', '\1'..l1..l2, true))
+        assertEquals(digest.tree('sha256', ''), digest.digest('sha256', ''))
+    end
@@ -0,0 +1,60 @@
+local kdf = require'openssl'.kdf
+
+TestKDF = {}
+    function TestKDF:setUp()
+        self.ikm = string.rep('\x0b', 22)
+        self.salt = '\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c'
+        self.info = '\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9'
+        self.okm = '3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865'
+    end
+
+    function TestKDF:testPBKDF2()
+        -- RFC 6070
+        local key = kdf.pbkdf2('password', 'salt', 2, 20, 'sha1')
+        assertEquals(openssl.hex(key), 'ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957')
+        assertEquals(#kdf.pbkdf2('password', 'salt', 1, 32), 32)
+    end
+
+    function TestKDF:testHKDF()
+        -- RFC 5869 test case 1
+        local okm = kdf.hkdf('sha256', self.ikm, self.salt, self.info, 42)
+        assertEquals(openssl.hex(okm), self.okm)
+
+        local prk = kdf.hkdf_extract('sha256', self.ikm, self.salt)
+        assertEquals(openssl.hex(prk), '077709362c2e32df0ddc3f0dc47bba6390b6c73bb50f9c3122ec844ad7c2b3e5')
+        assertEquals(kdf.hkdf_expand('sha256', prk, self.info, 42), okm)
+
+        assertErrorMsgContains('keylen', kdf.hkdf, 'sha256', self.ikm, nil, nil, 255 * 32 + 1)
+        assertErrorMsgContains('#5', kdf.hkdf, 'sha256', self.ikm, self.salt, self.info, 0)
+        assertErrorMsgContains('#4', kdf.pbkdf2, 'password', 'salt', 2, -1)
+    end
+
+    function TestKDF:testScrypt()
+        if not kdf.scrypt then return end
+        -- RFC 7914
+        local key = kdf.scrypt('password', 'NaCl', 1024, 8, 16, 64)
+        assertEquals(openssl.hex(key):sub(1, 32), 'fdbabe1c9d3472007856e7190d01e9fe')
+        assertErrorMsgContains('#3', kdf.scrypt, 'password', 'NaCl', -1024, 8, 16, 64)
+        assertErrorMsgContains('#4', kdf.scrypt, 'password', 'NaCl', 1024, 0, 16, 64)
+        assertErrorMsgContains('#5', kdf.scrypt, 'password', 'NaCl', 1024, 8, -16, 64)
+    end
+
+    function TestKDF:testAsync()
+        local job = kdf.async('pbkdf2', 'password', 'salt', 2, 20, 'sha1')
+        assertEquals(type(job:done()), 'boolean')
+        assertEquals(openssl.hex(job:result()), 'ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957')
+        assert(job:done())
+
+        job = kdf.async('hkdf', 'sha256', self.ikm, self.salt, self.info, 42)
+        assertEquals(openssl.hex(job:result()), self.okm)
+        job = nil
+        collectgarbage()
+
+        -- unfinished jobs are left to their threads
+        for i = 1, 4 do
+            kdf.async('pbkdf2', 'password', 'salt', 100000, 32, 'sha256')
+        end
+        collectgarbage()
+
+        assertError(kdf.async, 'unknown', 'password')
+    end
@@ -109,4 +109,145 @@ TestCipherMY = {}
         assertEquals(#k,t.key_length)
         assertEquals(#i,t.iv_length)
     end
-    
\ No newline at end of file
+    
+TestCipherAEAD = {}
+    function TestCipherAEAD:setUp()
+        self.msg = 'abcdabcdabcdabcdabcdabcd'
+        self.aad = 'header'
+        self.nonce = string.rep('n', 12)
+    end
+
+    function TestCipherAEAD:testSealOpen()
+        for _, alg in ipairs({'aes-128-gcm', 'aes-256-ccm', 'chacha20-poly1305'}) do
+            local C = cipher.get(alg)
+            if C then
+                local key = string.rep('k', C:info().key_length)
+                local c, tag = assert(cipher.seal(alg, key, self.nonce, self.msg, self.aad))
+                assertEquals(#c, #self.msg)
+                assertEquals(#tag, 16)
+                assertEquals(cipher.open(alg, key, self.nonce, c, tag, self.aad), self.msg)
+                assertEquals(C:open(key, self.nonce, c, tag, self.aad), self.msg)
+
+                local bad = string.char((tag:byte(1) + 1) % 256)..tag:sub(2)
+                assertEquals(cipher.open(alg, key, self.nonce, c, bad, self.aad), nil)
+                assertEquals(cipher.open(alg, key, self.nonce, c, tag, 'other'), nil)
+            end
+        end
+    end
+
+    function TestCipherAEAD:testContext()
+        local key = string.rep('k', 16)
+        local enc = cipher.encrypt_new('aes-128-gcm', key, self.nonce)
+        assert(enc:aad(self.aad))
+        local c = assert(enc:update(self.msg))..assert(enc:final())
+        local tag = assert(enc:tag())
+
+        local c1, tag1 = cipher.seal('aes-128-gcm', key, self.nonce, self.msg, self.aad)
+        assertEquals(c, c1)
+        assertEquals(tag, tag1)
+
+        local dec = cipher.decrypt_new('aes-128-gcm', key, self.nonce)
+        assert(dec:aad(self.aad))
+        local m = assert(dec:update(c))
+        assert(dec:tag(tag))
+        assertEquals(m..assert(dec:final()), self.msg)
+
+        if cipher.get('aes-128-ccm') then
+            local ccm = cipher.encrypt_new('aes-128-ccm', key, self.nonce)
+            assertErrorMsgContains('CCM can not stream', ccm.aad, ccm, self.aad)
+            assertErrorMsgContains('CCM can not stream', ccm.tag, ccm)
+        end
+    end
+
+    function TestCipherAEAD:testReset()
+        local key = string.rep('k', 16)
+        local iv1, iv2 = string.rep('1', 16), string.rep('2', 16)
+        local alg = 'aes-128-cbc'
+        local obj = cipher.encrypt_new(alg, key, iv1)
+        local a = assert(obj:update(self.msg))..assert(obj:final())
+        assertEquals(a, cipher.encrypt(alg, self.msg, key, iv1))
+
+        assert(obj:reset(iv2))
+        local b = assert(obj:update(self.msg))..assert(obj:final())
+        assertEquals(b, cipher.encrypt(alg, self.msg, key, iv2))
+
+        local key2 = string.rep('K', 16)
+        assert(obj:reset(iv1, key2))
+        local c = assert(obj:update(self.msg))..assert(obj:final())
+        assertEquals(c, cipher.encrypt(alg, self.msg, key2, iv1))
+
+        local dec = cipher.decrypt_new(alg, key2, iv1)
+        assertEquals(assert(dec:update(c))..assert(dec:final()), self.msg)
+        assert(dec:reset(iv2, key))
+        assertEquals(assert(dec:update(b))..assert(dec:final()), self.msg)
+    end
+
+    function TestCipherAEAD:testParallel()
+        local data = openssl.random(300000)
+        local key, ctr = string.rep('k', 16), string.rep('c', 16)
+
+        local c = assert(cipher.encrypt_parallel('aes-128-ctr', key, ctr, data, {threads=4}))
+        assertEquals(c, cipher.encrypt('aes-128-ctr', data, key, ctr))
+        assertEquals(cipher.decrypt_parallel('aes-128-ctr', key, ctr, c, {threads=3}), data)
+
+        local c1, tag1 = cipher.seal('aes-128-gcm', key, self.nonce, data, self.aad)
+        local c2, tag2 = assert(cipher.encrypt_parallel('aes-128-gcm', key, self.nonce, data, {threads=4, aad=self.aad}))
+        assertEquals(c2, c1)
+        assertEquals(tag2, tag1)
+
+        local m = assert(cipher.decrypt_parallel('aes-128-gcm', key, self.nonce, c2, {aad=self.aad, tag=tag2}))
+        assertEquals(m, data)
+        assertEquals(cipher.decrypt_parallel('aes-128-gcm', key, self.nonce, c2, {tag=tag2}), nil)
+
+        local b = openssl.buffer.new(data)
+        local _, tag3 = assert(cipher.encrypt_parallel('aes-128-gcm', key, self.nonce, b, {aad=self.aad}))
+        assertEquals(b:tostring(), c1)
+        assertEquals(tag3, tag1)
+
+        local e = openssl.buffer.new(0)
+        local _, tag4 = assert(cipher.encrypt_parallel('aes-128-gcm', key, self.nonce, e))
+        assertEquals(e:len(), 0)
+        assertEquals(tag4, select(2, cipher.seal('aes-128-gcm', key, self.nonce, '')))
+        assert(cipher.decrypt_parallel('aes-128-ctr', key, ctr, openssl.buffer.new('')))
+    end
+
+    function TestCipherAEAD:testFile()
+        local src, enc, dec = os.tmpname(), os.tmpname(), os.tmpname()
+        local data = openssl.random(200000)
+        local f = assert(io.open(src, 'wb'))
+        f:write(data)
+        f:close()
+        local function slurp(path)
+            local fp = assert(io.open(path, 'rb'))
+            local s = fp:read('*a')
+            fp:close()
+            return s
+        end
+
+        local key, iv = string.rep('k', 16), string.rep('i', 16)
+        assert(cipher.encrypt_file('aes-128-cbc', key, iv, src, enc))
+        assertEquals(slurp(enc), cipher.encrypt('aes-128-cbc', data, key, iv))
+        assertEquals(cipher.decrypt_file('aes-128-cbc', key, iv, enc, dec), #data)
+        assertEquals(slurp(dec), data)
+
+        local n, tag = assert(cipher.encrypt_file('aes-128-gcm', key, self.nonce, src, enc))
+        assertEquals(n, #data)
+        local c1, tag1 = cipher.seal('aes-128-gcm', key, self.nonce, data)
+        assertEquals(tag, tag1)
+        assertEquals(slurp(enc), c1)
+        assert(cipher.decrypt_file('aes-128-gcm', key, self.nonce, enc, dec, tag))
+        assertEquals(slurp(dec), data)
+        local bad = string.rep('\0', 16)
+        assertEquals(cipher.decrypt_file('aes-128-gcm', key, self.nonce, enc, dec, bad), nil)
+        assertEquals(io.open(dec, 'rb'), nil)
+
+        -- output over input is refused before input is truncated
+        assertErrorMsgContains('same file as input', cipher.encrypt_file, 'aes-128-cbc', key, iv, src, src)
+        assertEquals(slurp(src), data)
+        -- missing input leaves an existing output alone
+        assertEquals(cipher.encrypt_file('aes-128-cbc', key, iv, src .. '.missing', enc), nil)
+        assertEquals(slurp(enc), c1)
+
+        os.remove(src)
+        os.remove(enc)
+    end
@@ -0,0 +1,534 @@
+local openssl = require'openssl'
+local ssl,bio = openssl.ssl,openssl.bio
+
+local function handshake(cli, srv)
+    local c, s
+    for i=1,16 do
+        c = cli:handshake()
+        s = srv:handshake()
+        assert(c~=nil and s~=nil, 'handshake failed')
+        if c and s then
+            return true
+        end
+    end
+    return false
+end
+
+-- write data to a temporary file, return its path
+local function tmpfile(data)
+    local path = os.tmpname()
+    local f = assert(io.open(path, 'wb'))
+    f:write(data)
+    f:close()
+    return path
+end
+
+-- sendfile length bytes of path from offset, resuming on want_read/want_write,
+-- and return what srv received
+local function sendfile_through(cli, srv, path, offset, length)
+    local got, left = {}, length
+    for i=1,10000 do
+        if left == 0 then break end
+        local n, reason = cli:sendfile(path, offset + length - left, left)
+        assert(n, reason)
+        if reason then
+            assert(reason == 'want_write' or reason == 'want_read', reason)
+        end
+        left = left - n
+        repeat
+            local s = srv:read()
+            if s then got[#got+1] = s end
+        until not s
+    end
+    for i=1,10000 do
+        local s = table.concat(got)
+        if #s >= length then return s end
+        s = srv:read()
+        if s then got[#got+1] = s end
+    end
+    return table.concat(got)
+end
+
+TestSSLPair = {}
+    function TestSSLPair:setUp()
+        local dn = openssl.x509.name.new({{CN='localhost'}})
+        self.pkey = assert(openssl.pkey.new())
+        local req = assert(openssl.csr.new(dn, self.pkey))
+        self.cert = assert(req:to_x509(self.pkey, 365))
+
+        self.sctx = assert(ssl.ctx_new('SSLv23_server'))
+        assert(self.sctx:use(self.pkey, self.cert))
+        self.cctx = assert(ssl.ctx_new('SSLv23_client'))
+    end
+
+    function TestSSLPair:testBIOPair()
+        local a,b = assert(bio.pair(1024))
+        assertEquals(a:write('abcd'), 4)
+        assertEquals(b:read(4), 'abcd')
+        assertEquals(b:write('efgh'), 4)
+        assertEquals(a:read(4), 'efgh')
+        assertErrorMsgContains('negative', bio.pair, -1)
+        assertErrorMsgContains('negative', ssl.pair, self.cctx, self.sctx, -1)
+    end
+
+    function TestSSLPair:testHandshake()
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx, 16384))
+        assert(handshake(cli, srv))
+        assertEquals(cli:write('hello'), 5)
+        assertEquals(srv:read(), 'hello')
+        assertEquals(srv:write('world'), 5)
+        assertEquals(cli:read(), 'world')
+    end
+
+    function TestSSLPair:testSendfilePair()
+        local data = openssl.random(50000)
+        local path = tmpfile(data)
+        -- small pair buffer makes sendfile stop with want_write and resume
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx, 4096))
+        assert(handshake(cli, srv))
+        assertEquals(sendfile_through(cli, srv, path, 100, 40000), data:sub(101, 40100))
+
+        -- plain writes still work after a resumed sendfile
+        assertEquals(cli:write('tail'), 4)
+        assertEquals(srv:read(), 'tail')
+
+        -- offset past end of file sends nothing
+        assertEquals(cli:sendfile(path, #data + 10), 0)
+        local n, reason = cli:sendfile(path .. '.missing')
+        assertNil(n)
+        assertIsString(reason)
+        os.remove(path)
+    end
+
+    function TestSSLPair:testSNIMap()
+        local dn = openssl.x509.name.new({{CN='tenant'}})
+        local req = assert(openssl.csr.new(dn, self.pkey))
+        local tctx = assert(ssl.ctx_new('SSLv23_server'))
+        assert(tctx:use(self.pkey, assert(req:to_x509(self.pkey, 365))))
+
+        assertEquals(self.sctx:sni_map({['*.Example.com']=tctx}), 1)
+        assert(self.sctx:sni_add('www.example.org', tctx))
+        local exact, wild = self.sctx:sni_map()
+        assertEquals(exact, 1)
+        assertEquals(wild, 1)
+
+        -- a bad entry raises and keeps the installed map
+        assertError(self.sctx.sni_map, self.sctx, {['a.example.net']=tctx, ['b.example.net']='bad'})
+        assertError(self.sctx.sni_map, self.sctx, {['a.example.net']=tctx, ['*.']=tctx})
+        exact, wild = self.sctx:sni_map()
+        assertEquals(exact, 1)
+        assertEquals(wild, 1)
+
+        for _, host in ipairs({'a.example.com', 'WWW.example.org.'}) do
+            local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+            cli:set('hostname', host)
+            assert(handshake(cli, srv))
+            assertEquals(cli:peer():subject():oneline(), '/CN=tenant')
+        end
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        cli:set('hostname', 'example.com')
+        assert(handshake(cli, srv))
+        assertEquals(cli:peer():subject():oneline(), '/CN=localhost')
+
+        assert(self.sctx:sni_remove('*.example.com'))
+        assertEquals(self.sctx:sni_remove('*.example.com'), false)
+    end
+
+    function TestSSLPair:testSwapCert()
+        if not self.sctx.swap_cert then return end
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(cli:peer():subject():oneline(), '/CN=localhost')
+
+        local pkey = assert(openssl.pkey.new())
+        local dn = openssl.x509.name.new({{CN='rotated'}})
+        local req = assert(openssl.csr.new(dn, pkey))
+        local cert = assert(req:to_x509(pkey, 1))
+        assert(not self.sctx:swap_cert(self.pkey, cert))
+        assert(self.sctx:swap_cert(pkey, cert))
+
+        local cli2, srv2 = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli2, srv2))
+        assertEquals(cli2:peer():subject():oneline(), '/CN=rotated')
+        assertEquals(cli:peer():subject():oneline(), '/CN=localhost')
+    end
+
+    function TestSSLPair:testTmpDH()
+        local calls = 0
+        self.sctx:set_tmp('dh', function(is_export, keylength)
+            calls = calls + 1
+            return 'ffdhe2048'
+        end)
+        for i=1,3 do
+            local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+            cli:set('cipher_list', 'DHE-RSA-AES128-SHA:DHE-RSA-AES256-SHA')
+            assert(handshake(cli, srv))
+        end
+        assert(calls <= 1)
+        self.sctx:set_tmp('dh', 'ffdhe3072')
+    end
+
+    function TestSSLPair:testVerifyCache()
+        assert(self.cctx:use(self.pkey, self.cert))
+        self.sctx:cert_store(openssl.x509.store.new({self.cert}))
+        self.sctx:set_verify({'peer', 'fail_if_no_peer_cert'})
+        assert(self.sctx:verify_cache(true, 60, 16))
+        for i=1,3 do
+            local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+            assert(handshake(cli, srv))
+            assert(srv:getpeerverification())
+        end
+        local hits, misses = self.sctx:verify_cache()
+        assertEquals(misses, 1)
+        assertEquals(hits, 2)
+
+        self.sctx:verify_depth(4)
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        hits, misses = self.sctx:verify_cache()
+        assertEquals(misses, 2)
+        assert(self.sctx:verify_cache(false))
+
+        assertError(self.sctx.verify_cache, self.sctx, true, 60, -1)
+        assertError(self.sctx.verify_cache, self.sctx, true, 60, 2^24 + 1)
+    end
+
+    function TestSSLPair:testVerifyCacheStore()
+        local dn = openssl.x509.name.new({{CN='client'}})
+        local req = assert(openssl.csr.new(dn, self.pkey))
+        local cert = openssl.x509.new(7, req)
+        cert:validat(os.time() - 60, os.time() + 3600)
+        assert(cert:sign(self.pkey, cert))
+        assert(self.cctx:use(self.pkey, cert))
+
+        local store = openssl.x509.store.new({cert})
+        self.sctx:cert_store(store)
+        self.sctx:set_verify({'peer', 'fail_if_no_peer_cert'})
+        assert(self.sctx:verify_cache(true, 60, 16))
+        for i=1,2 do
+            local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+            assert(handshake(cli, srv))
+        end
+        local hits, misses = self.sctx:verify_cache()
+        assertEquals(hits, 1)
+        assertEquals(misses, 1)
+
+        -- any change through x509_store drops cached chains
+        assert(store:add(self.cert))
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        hits, misses = self.sctx:verify_cache()
+        assertEquals(hits, 1)
+        assertEquals(misses, 2)
+
+        -- lua cert verify callback sees every chain, cache is bypassed
+        local calls = 0
+        self.sctx:set_cert_verify(function() calls = calls + 1 return 1 end)
+        for i=1,2 do
+            cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+            assert(handshake(cli, srv))
+        end
+        assertEquals(calls, 2)
+        hits, misses = self.sctx:verify_cache()
+        assertEquals(hits, 1)
+        assertEquals(misses, 2)
+        self.sctx:set_cert_verify()
+
+        -- newly revoked chain is rejected although it was cached
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        local list = assert(openssl.crl.new({{sn=7, time=os.time()}}, cert, self.pkey))
+        assert(store:add(list))
+        assert(store:flags(4))    -- X509_V_FLAG_CRL_CHECK
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        local ok, done = pcall(handshake, cli, srv)
+        assert(not (ok and done))
+        assert(self.sctx:verify_cache(false))
+    end
+
+    function TestSSLPair:testHostnameCheck()
+        if not self.cctx.verify_hostname then return end
+        self.cctx:cert_store(openssl.x509.store.new({self.cert}))
+        self.cctx:set_verify({'peer'})
+        assert(self.cctx:verify_hostname(true))
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        cli:set('hostname', 'localhost')
+        assert(handshake(cli, srv))
+        assert(cli:getpeerverification())
+
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(cli:set_hostname_check('example.com'))
+        local ok = pcall(handshake, cli, srv)
+        assert(not ok or not cli:getpeerverification())
+    end
+
+    function TestSSLPair:testStats()
+        assertEquals(self.sctx:stats(), nil)
+        assertEquals(self.sctx:telemetry(), false)
+        assert(self.sctx:telemetry(true))
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(cli:write('hello'), 5)
+        assertEquals(srv:read(), 'hello')
+
+        local st = assert(self.sctx:stats())
+        assertEquals(st.handshakes_started, 1)
+        assertEquals(st.handshakes_completed, 1)
+        assertEquals(st.handshakes_failed, 0)
+        assertEquals(st.bytes_in, 5)
+        assertEquals(#st.handshake_ms, 16)
+        local conn = srv:stats()
+        assertEquals(conn.handshakes, 1)
+        assertEquals(conn.bytes_in, 5)
+        assertEquals(cli:stats().bytes_out, 5)
+
+        st = self.sctx:stats(true)
+        assertEquals(self.sctx:stats().handshakes_completed, 0)
+
+        assertEquals(self.sctx:telemetry(false), false)
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(self.sctx:stats().handshakes_completed, 0)
+        assertEquals(srv:stats().handshakes, 0)
+    end
+
+    function TestSSLPair:testTimings()
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(srv:timings(), nil)
+
+        assert(self.sctx:trace(true))
+        assert(self.sctx:telemetry())
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        local t = assert(srv:timings())
+        assert(t.received.client_hello)
+        assert(t.sent.server_hello)
+        assert(t.total >= t.sent.server_hello)
+        assertEquals(t.lua, 0)
+    end
+
+    function TestSSLPair:testLowMemory()
+        assert(self.sctx:low_memory(true, 8))
+        assert(self.sctx:telemetry(true))
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(cli:write('hello'), 5)
+        assertEquals(srv:read(), 'hello')
+        local m = assert(srv:memory())
+        assert(m.total >= m.ext)
+        if m.read_buffer then
+            assertEquals(m.read_buffer, 0)
+        end
+        assertEquals(self.sctx:stats().connections, 1)
+        assertEquals(self.sctx:low_memory(false), false)
+    end
+
+    function TestSSLPair:testTicketKeys()
+        if not self.sctx.ticket_keys then return end
+        local keys = {openssl.random(48), openssl.random(48)}
+        local sctx2 = assert(ssl.ctx_new('SSLv23_server'))
+        assert(sctx2:use(self.pkey, self.cert))
+        assert(sctx2:telemetry(true))
+        assertEquals(self.sctx:ticket_keys({keys[2]}), 1)
+        assertEquals(sctx2:ticket_keys(keys), 2)
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(srv:write('ping'), 4)
+        assertEquals(cli:read(), 'ping')
+        local sess = assert(cli:session())
+
+        -- ticket issued by the old key is accepted by the other worker
+        cli, srv = assert(ssl.pair(self.cctx, sctx2))
+        cli:session(sess)
+        assert(handshake(cli, srv))
+        assertEquals(sctx2:stats().resumptions, 1)
+        assertEquals(sctx2:ticket_keys(), 2)
+    end
+
+    function TestSSLPair:testALPN()
+        if not self.sctx.alpn then return end
+        assert(self.sctx:alpn({'h2', 'http/1.1'}))
+        assert(self.cctx:alpn({'http/1.1'}))
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(srv:alpn_selected(), 'http/1.1')
+        assertEquals(cli:alpn_selected(), 'http/1.1')
+
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(cli:alpn({'spdy/3', 'h2'}))
+        assert(handshake(cli, srv))
+        assertEquals(cli:alpn_selected(), 'h2')
+    end
+
+    function TestSSLPair:testOCSPStaple()
+        if not self.sctx.ocsp_staple then return end
+        local ok, reason = self.sctx:ocsp_staple('not a response')
+        assertEquals(ok, nil)
+        assert(reason)
+        assertEquals(self.sctx:ocsp_refresh(), nil)
+
+        local calls = 0
+        assertEquals(self.sctx:ocsp_staple(function() calls = calls + 1 return 'bad' end), nil)
+        assertEquals(calls, 1)
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(cli:ocsp_staple(true))
+        assert(handshake(cli, srv))
+        assertEquals(cli:ocsp_staple(), nil)
+    end
+
+    function TestSSLPair:testOCSPStapleRoundtrip()
+        if not self.sctx.ocsp_staple then return end
+        local ocsp = openssl.ocsp
+        -- self signed server cert is its own issuer and responder
+        local req = assert(ocsp.request_new(self.cert, self.cert))
+        local res = assert(ocsp.response_new(req, self.cert, self.cert, self.pkey, {}))
+        local der = assert(res:export())
+
+        local expire = assert(self.sctx:ocsp_staple(der))
+        assert(expire > os.time())
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(cli:ocsp_staple(true))
+        assert(handshake(cli, srv))
+        assertEquals(cli:ocsp_staple(), der)
+        assert(ocsp.response_read(cli:ocsp_staple()))
+
+        -- provider result is stapled the same way
+        local calls = 0
+        assert(self.sctx:ocsp_staple(function() calls = calls + 1 return der end))
+        assertEquals(calls, 1)
+        assert(self.sctx:ocsp_refresh())
+        assertEquals(calls, 1)    -- still fresh, provider not called again
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(cli:ocsp_staple(true))
+        assert(handshake(cli, srv))
+        assertEquals(cli:ocsp_staple(), der)
+
+        -- client that did not ask gets no staple
+        cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(cli:ocsp_staple(), nil)
+    end
+
+    function TestSSLPair:testDTLS()
+        if not self.sctx.dtls_cookie then return end
+        local ok, ctx = pcall(ssl.ctx_new, 'DTLS_server')
+        if not ok then return end
+        assert(ctx:use(self.pkey, self.cert))
+        assert(ctx:dtls_cookie('secret'))
+        assert(ctx:dtls_cookie())
+
+        local a, b = assert(bio.pair(1500))
+        local s = assert(ctx:ssl(a, true))
+        assertEquals(s:dtls_timeout(), nil)
+        assert(s:mtu(1200))
+    end
+
+    function TestSSLPair:testDTLSListen()
+        local ok, socket = pcall(require, 'socket')
+        if not ok or not self.sctx.dtls_cookie then return end
+        local sctx
+        ok, sctx = pcall(ssl.ctx_new, 'DTLS_server')
+        if not ok then return end
+        assert(sctx:use(self.pkey, self.cert))
+        assert(sctx:dtls_cookie('secret'))
+        local cctx = assert(ssl.ctx_new('DTLS_client'))
+
+        -- udp pair on loopback, luasocket keeps both non-blocking
+        local su = assert(socket.udp())
+        assert(su:setsockname('127.0.0.1', 0))
+        local cu = assert(socket.udp())
+        assert(cu:setpeername(su:getsockname()))
+        local srv = assert(sctx:ssl(bio.dgram(su:getfd()), true))
+        local cli = assert(cctx:ssl(bio.dgram(cu:getfd())))
+
+        -- ClientHello without cookie is answered by HelloVerifyRequest
+        assertEquals(cli:handshake(), false)
+        local ret, reason = srv:dtls_listen()
+        assertEquals(ret, false)
+        assertEquals(reason, 'want_read')
+
+        -- ClientHello with cookie is accepted, and tells who sent it
+        assertEquals(cli:handshake(), false)
+        local host, port = select(2, assert(srv:dtls_listen()))
+        local chost, cport = cu:getsockname()
+        assertEquals(host, chost)
+        assertEquals(port, cport)
+
+        assert(handshake(cli, srv))
+        assertEquals(cli:write('hello'), 5)
+        assertEquals(srv:read(), 'hello')
+        su:close()
+        cu:close()
+    end
+
+    function TestSSLPair:testEarlyData()
+        if not self.sctx.max_early_data then return end
+        assertEquals(self.sctx:max_early_data(16384), 16384)
+        assertEquals(self.sctx:max_early_data(), 16384)
+        assert(self.sctx:anti_replay(8192, 10))
+        assertEquals(self.sctx:anti_replay(), 0)
+
+        local seen = {}
+        assert(self.sctx:anti_replay(function(random)
+            if seen[random] then return false end
+            seen[random] = true
+            return true
+        end))
+
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assertEquals(cli:early_data_status(), 'not_sent')
+        assertEquals(self.sctx:max_early_data(0), 0)
+        assert(self.sctx:anti_replay(false))
+    end
+
+    function TestSSLPair:testEarlyDataReplay()
+        if not self.sctx.max_early_data then return end
+        self.sctx:max_early_data(16384)
+        assert(self.sctx:anti_replay(8192, 10))
+
+        -- full handshake, the ticket allows early data
+        local cli, srv = assert(ssl.pair(self.cctx, self.sctx))
+        assert(handshake(cli, srv))
+        assertEquals(srv:write('ping'), 4)
+        assertEquals(cli:read(), 'ping')
+        local sess = assert(cli:session())
+
+        -- resumed client, capture ClientHello and 0-RTT data
+        local cin, cout = bio.mem(), bio.mem()
+        cli = assert(self.cctx:ssl(cin, cout))
+        cli:session(sess)
+        assertEquals(cli:write_early_data('early'), 5)
+        local hello = assert(cout:read())
+
+        local function server()
+            local sin, sout = bio.mem(hello), bio.mem()
+            return assert(self.sctx:ssl(sin, sout, true)), sin, sout
+        end
+
+        local sin, sout
+        srv, sin, sout = server()
+        assertEquals(srv:read_early_data(), 'early')
+        cin:write(assert(sout:read()))
+        assert(cli:handshake())
+        sin:write(assert(cout:read()))
+        local ok, reason = srv:read_early_data()
+        assertEquals(ok, false)
+        assertEquals(reason, 'finish')
+        assert(srv:handshake())
+        assertEquals(srv:early_data_status(), 'accepted')
+        assertEquals(cli:early_data_status(), 'accepted')
+
+        -- the same flight replayed to another connection falls back to 1-RTT
+        srv = server()
+        ok, reason = srv:read_early_data()
+        assertEquals(ok, false)
+        assertEquals(reason, 'finish')
+        assertEquals(srv:early_data_status(), 'rejected')
+        assertEquals(self.sctx:anti_replay(), 1)
+    end
@@ -5,6 +5,7 @@ openssl.rand_load()
 
 dofile('0.engine.lua')
 dofile('0.misc.lua')
+dofile('0.buffer.lua')
 
 dofile('1.asn1.lua')
 dofile('1.x509_name.lua')
@@ -12,6 +13,7 @@ dofile('1.x509_extension.lua')
 dofile('1.x509_attr.lua')
 dofile('2.digest.lua')
 dofile('2.hmac.lua')
+dofile('2.kdf.lua')
 dofile('3.cipher.lua')
 dofile('4.pkey.lua')
 dofile('5.csr.lua')
@@ -20,6 +22,7 @@ dofile('5.x509.lua')
 dofile('5.ts.lua')
 dofile('6.pkcs7.lua')
 dofile('7.pkcs12.lua')
+dofile('8.ssl_pair.lua')
 
 LuaUnit:setVerbosity(0)
 io.read()